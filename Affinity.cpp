@@ -0,0 +1,172 @@
+#include "Affinity.hpp"
+#include "Logging.hpp"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        if (range.empty() || range == "\n") continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int c = first; c <= last; c++) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+static std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) cpus.push_back(c);
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        for (int c = 0; c < (int)std::max(1u, std::thread::hardware_concurrency()); c++) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+void pin_current_thread(const std::vector<int>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) CPU_SET(c, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        LOG_WARN("Could not pin thread to %zu CPUs\n", cpus.size());
+    }
+#else
+    (void)cpus;
+#endif
+}
+
+void pin_current_team(const std::vector<int>& cpus) {
+    pin_current_thread(cpus);
+#ifdef _OPENMP
+    const int threads = (int)cpus.size();
+    omp_set_num_threads(threads);
+    #pragma omp parallel num_threads(threads)
+    {
+        pin_current_thread({cpus[omp_get_thread_num() % threads]});
+    }
+#endif
+}
+
+std::vector<CoreGroup> partition_cores(int groups) {
+    if (groups <= 0) throw std::invalid_argument("need at least one core group");
+    const auto allowed = allowed_cpus();
+
+    // Allowed CPUs per NUMA node
+    std::vector<CoreGroup> nodes;
+    for (int n = 0;; n++) {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+        if (!in) break;
+        std::string list;
+        std::getline(in, list);
+        CoreGroup node{n, {}};
+        for (int c : parse_cpu_list(list)) {
+            if (std::find(allowed.begin(), allowed.end(), c) != allowed.end()) node.cpus.push_back(c);
+        }
+        if (!node.cpus.empty()) nodes.push_back(node);
+    }
+    if (nodes.empty()) nodes.push_back({0, allowed});
+
+    std::vector<CoreGroup> result;
+    if (groups <= (int)nodes.size()) {
+        for (int g = 0; g < groups; g++) result.push_back({nodes[g].node, {}});
+        for (size_t n = 0; n < nodes.size(); n++) {
+            CoreGroup& group = result[n % groups];
+            if (n >= (size_t)groups) group.node = -1;
+            group.cpus.insert(group.cpus.end(), nodes[n].cpus.begin(), nodes[n].cpus.end());
+        }
+        return result;
+    }
+
+    // More groups than nodes: share the groups out evenly, then cut
+    for (size_t n = 0; n < nodes.size(); n++) {
+        const int count = groups / (int)nodes.size() + ((int)n < groups % (int)nodes.size() ? 1 : 0);
+        const auto& cpus = nodes[n].cpus;
+        for (int g = 0; g < count; g++) {
+            size_t begin = cpus.size() * g / count, end = cpus.size() * (g + 1) / count;
+            if (end == begin) end = begin + 1;  // more groups than CPUs: share
+            begin = std::min(begin, cpus.size() - 1);
+            end = std::min(end, cpus.size());
+            result.push_back({nodes[n].node, std::vector<int>(cpus.begin() + begin, cpus.begin() + end)});
+        }
+    }
+    return result;
+}
+
+AffinityWorker::AffinityWorker(const CoreGroup& group) : group(group) {
+    thread = std::thread(&AffinityWorker::loop, this);
+}
+
+AffinityWorker::~AffinityWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void AffinityWorker::loop() {
+    pin_current_team(group.cpus);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [this] { return stop || !tasks.empty(); });
+        if (tasks.empty()) return;  // stopping with nothing queued
+        auto current = std::move(tasks.front());
+        tasks.pop_front();
+        lock.unlock();
+        current();  // the packaged task stores what it throws
+        lock.lock();
+    }
+}
+
+std::future<void> AffinityWorker::submit(std::function<void()> task) {
+    std::packaged_task<void()> packaged(std::move(task));
+    auto result = packaged.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(packaged));
+    }
+    cv.notify_all();
+    return result;
+}
+
+void AffinityWorker::run(std::function<void()> task) {
+    submit(std::move(task)).get();
+}
+
+const std::vector<std::shared_ptr<AffinityWorker>>& affinity_workers(int groups) {
+    static std::mutex registry_mutex;
+    static std::map<int, std::vector<std::shared_ptr<AffinityWorker>>> registry;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    auto& workers = registry[groups];
+    if (workers.empty()) {
+        for (const auto& group : partition_cores(groups)) {
+            LOG_INFO("Core group %zu: node %d, %zu CPUs\n", workers.size(), group.node, group.cpus.size());
+            workers.push_back(std::make_shared<AffinityWorker>(group));
+        }
+    }
+    return workers;
+}
@@ -0,0 +1,74 @@
+#ifndef AFFINITY_HPP
+#define AFFINITY_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A set of CPUs, on one NUMA node unless `node` is -1
+struct CoreGroup {
+    int node = 0;  // -1 = spans several nodes
+    std::vector<int> cpus;
+};
+
+// Parse a CPU list such as "0-3,8-11" (sysfs / taskset syntax)
+std::vector<int> parse_cpu_list(const std::string& list);
+
+// Pin the calling thread to `cpus` (no-op outside Linux)
+void pin_current_thread(const std::vector<int>& cpus);
+
+// Pin the calling thread to `cpus` and give it an OpenMP team of one thread
+// per CPU, each pinned to its own CPU. Later parallel regions of that size
+// from this thread reuse the team.
+void pin_current_team(const std::vector<int>& cpus);
+
+// Split the CPUs this process may use into `groups` groups. With at least
+// as many groups as nodes, each node is cut into contiguous chunks and no
+// group spans nodes. With fewer, nodes are dealt out whole and a group may
+// get several (node -1): memory its team first touches is spread over
+// them, so such a group is not node-local. Nodes come from /sys; without
+// it all CPUs are node 0.
+std::vector<CoreGroup> partition_cores(int groups);
+
+// A persistent thread pinned to a core group. Its OpenMP team has one
+// thread per CPU, each pinned to its own CPU, so oneDNN primitives run from
+// a task stay on the group and memory first written there is allocated on
+// the group's node. Runs one task at a time, in submission order; any
+// number of callers may submit.
+class AffinityWorker {
+public:
+    explicit AffinityWorker(const CoreGroup& group);
+    ~AffinityWorker();
+    AffinityWorker(const AffinityWorker&) = delete;
+    AffinityWorker& operator=(const AffinityWorker&) = delete;
+
+    // Queue `task`; the future rethrows what it threw
+    std::future<void> submit(std::function<void()> task);
+    // submit and wait for the result
+    void run(std::function<void()> task);
+
+    const CoreGroup& get_group() const { return group; }
+
+private:
+    void loop();
+
+    CoreGroup group;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::packaged_task<void()>> tasks;
+    bool stop = false;
+    std::thread thread;
+};
+
+// Workers for partition_cores(groups), created once per group count and
+// shared by every caller asking for the same count; tasks of concurrent
+// callers queue on them
+const std::vector<std::shared_ptr<AffinityWorker>>& affinity_workers(int groups);
+
+#endif // AFFINITY_HPP
@@ -0,0 +1,146 @@
+#include "BranchExecutor.hpp"
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace dnnl;
+
+std::vector<int> partition_threads(const std::vector<double>& costs, int threads) {
+    const int n = (int)costs.size();
+    if (n > threads) throw std::invalid_argument("more branches than threads");
+    std::vector<int> result(n, 1);
+    const int spare = threads - n;
+    double total = 0.0;
+    for (double c : costs) total += std::max(c, 0.0);
+    if (n == 0 || spare == 0) return result;
+
+    std::vector<std::pair<double, int>> remainders;
+    int given = 0;
+    for (int i = 0; i < n; i++) {
+        double share = total > 0.0 ? std::max(costs[i], 0.0) / total * spare : (double)spare / n;
+        int whole = (int)std::floor(share);
+        result[i] += whole;
+        given += whole;
+        remainders.push_back({share - whole, i});
+    }
+    std::sort(remainders.begin(), remainders.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    for (int i = 0; given < spare; i++, given++) result[remainders[i % n].second]++;
+    return result;
+}
+
+BranchExecutor::BranchExecutor(const engine& eng, int max_threads) : max_threads(max_threads) {
+    if (this->max_threads <= 0) {
+#ifdef _OPENMP
+        this->max_threads = omp_get_max_threads();
+#else
+        this->max_threads = std::max(1u, std::thread::hardware_concurrency());
+#endif
+    }
+    for (int w = 0; w < this->max_threads; w++) streams.emplace_back(eng);
+}
+
+BranchExecutor::~BranchExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto& t : threads) t.join();
+}
+
+// Longest branch first onto the least loaded of `workers` workers; returns
+// the loads
+std::vector<double> BranchExecutor::pack(const std::vector<double>& costs, int workers, BranchPlan& plan) const {
+    const int n = (int)costs.size();
+    std::vector<int> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return costs[a] > costs[b]; });
+    plan.assigned.resize(workers);
+    for (auto& branches : plan.assigned) branches.clear();
+    std::vector<double> load(workers, 0.0);
+    for (int b : order) {
+        int w = (int)(std::min_element(load.begin(), load.end()) - load.begin());
+        plan.assigned[w].push_back(b);
+        load[w] += std::max(costs[b], 1.0);
+    }
+    return load;
+}
+
+void BranchExecutor::plan(const std::vector<double>& costs, BranchPlan& plan) const {
+    const int workers = std::min((int)costs.size(), max_threads);
+    plan.threads = partition_threads(pack(costs, workers, plan), max_threads);
+}
+
+void BranchExecutor::plan_even(const std::vector<double>& costs, int workers, BranchPlan& plan) const {
+    workers = std::max(1, std::min(workers, max_threads));
+    pack(costs, workers, plan);
+    plan.threads.assign(workers, max_threads / workers);
+}
+
+void BranchExecutor::work(int worker) {
+    try {
+#ifdef _OPENMP
+        omp_set_num_threads(job->threads[worker]);
+#endif
+        for (int b : job->assigned[worker]) (*body)(b, worker);
+        streams[worker].wait();
+    } catch (...) {
+        errors[worker] = std::current_exception();
+    }
+}
+
+void BranchExecutor::worker_loop(int worker, uint64_t seen) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+            // Not part of this run, or woke after it ended
+            if (!job || worker >= (int)job->assigned.size()) continue;
+        }
+        work(worker);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) done.notify_one();
+    }
+}
+
+void BranchExecutor::run(const BranchPlan& plan, const std::function<void(int, int)>& body) {
+    const int workers = (int)plan.assigned.size();
+    if (workers == 0) return;
+    errors.assign(workers, nullptr);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &plan;
+        this->body = &body;
+        while ((int)threads.size() < workers - 1) {
+            threads.emplace_back(&BranchExecutor::worker_loop, this, (int)threads.size() + 1, generation);
+        }
+        pending = workers - 1;
+        if (pending > 0) generation++;
+    }
+    wake.notify_all();
+
+#ifdef _OPENMP
+    const int caller_threads = omp_get_max_threads();
+#endif
+    work(0);
+#ifdef _OPENMP
+    omp_set_num_threads(caller_threads);
+#endif
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return pending == 0; });
+        job = nullptr;
+    }
+
+    for (auto& e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef BRANCH_EXECUTOR_HPP
+#define BRANCH_EXECUTOR_HPP
+
+#include "oneapi/dnnl/dnnl.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Split `threads` among branches: one each, the rest in proportion to
+// `costs` (largest remainder). Needs costs.size() <= threads.
+std::vector<int> partition_threads(const std::vector<double>& costs, int threads);
+
+// Which worker runs which branches, and on how many OpenMP threads
+struct BranchPlan {
+    std::vector<std::vector<int>> assigned;  // branch indices per worker
+    std::vector<int> threads;                // team size per worker
+};
+
+// Runs independent branches (e.g. ops that share no tensors) at the same
+// time on partitions of the OpenMP threads. A single small GEMM cannot keep
+// a many-core socket busy; several of them side by side can.
+//
+// Branches are packed onto at most max_workers() workers, biggest first onto
+// the least loaded one, and each worker runs them on an OpenMP team of its
+// planned size. oneDNN sizes a primitive for the thread count at creation,
+// so a branch's primitive must be created for its worker's team (see
+// AttrSpec::threads); plans are made once, before the primitives. Every
+// worker has its own in-order stream. Worker 0 is the calling thread; the
+// others are started on first use and kept for the executor's lifetime.
+class BranchExecutor {
+public:
+    // max_threads = 0 uses omp_get_max_threads()
+    explicit BranchExecutor(const dnnl::engine& eng, int max_threads = 0);
+    ~BranchExecutor();
+    BranchExecutor(const BranchExecutor&) = delete;
+    BranchExecutor& operator=(const BranchExecutor&) = delete;
+
+    int max_workers() const { return max_threads; }
+    dnnl::stream& worker_stream(int worker) { return streams[worker]; }
+
+    // Pack the branches onto min(branches, max_workers()) workers and split
+    // the threads by each worker's load
+    void plan(const std::vector<double>& costs, BranchPlan& plan) const;
+    // Pack the branches onto `workers` workers of max_workers() / workers
+    // threads each, for branches whose costs are only known at run time
+    // (their primitives are created for that fixed share)
+    void plan_even(const std::vector<double>& costs, int workers, BranchPlan& plan) const;
+
+    // Call body(branch, worker) for every branch of `plan`. Returns once all
+    // branches have finished and the worker streams are idle; rethrows the
+    // first exception a branch threw. Not reentrant.
+    void run(const BranchPlan& plan, const std::function<void(int, int)>& body);
+
+private:
+    std::vector<double> pack(const std::vector<double>& costs, int workers, BranchPlan& plan) const;
+    void work(int worker);
+    void worker_loop(int worker, uint64_t seen);
+
+    int max_threads;
+    std::vector<dnnl::stream> streams;
+
+    // Current run, read by the workers
+    const BranchPlan* job = nullptr;
+    const std::function<void(int, int)>* body = nullptr;
+    std::vector<std::exception_ptr> errors;
+
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::vector<std::thread> threads;  // workers 1..n, started on demand
+    uint64_t generation = 0;
+    int pending = 0;
+    bool stop = false;
+};
+
+#endif // BRANCH_EXECUTOR_HPP
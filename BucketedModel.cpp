@@ -0,0 +1,100 @@
+#include "BucketedModel.hpp"
+#include "Logging.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+using namespace dnnl;
+
+static int round_up_pow2(int v) {
+    int p = 1;
+    while (p < v) p *= 2;
+    return p;
+}
+
+BucketedModel::BucketedModel(engine& eng, const ModelConfig& config, int max_batch, int max_seq,
+    int min_seq, PrimitiveCache& cache)
+    : eng(eng), config(config) {
+
+    this->config.padding_mask = true;
+    weights = create_model_weights(eng, this->config);
+
+    for (int b = 1; b <= round_up_pow2(max_batch); b *= 2) {
+        for (int s = round_up_pow2(min_seq); s <= round_up_pow2(max_seq); s *= 2) {
+            ModelConfig bucket_config = this->config;
+            bucket_config.batch = b;
+            bucket_config.seq_len = s;
+            LOG_DEBUG("Building bucket batch=%d seq_len=%d\n", b, s);
+            buckets.push_back({b, s, build_model_pipeline(eng, bucket_config, weights, cache)});
+        }
+    }
+
+    // Every bucket has the same layers, so the first one tells
+    const PrimitivePipeline& first = buckets.front().pipeline;
+    output_name = first.writes_tensor("moe_out") ? "moe_out" : "block_out";
+    if (!first.writes_tensor(output_name)) {
+        throw std::invalid_argument("bucketed model has no layer that writes " + output_name);
+    }
+}
+
+BucketedModel::Bucket& BucketedModel::route(int batch, int seq_len) {
+    Bucket* best = nullptr;
+    for (auto& bucket : buckets) {
+        if (bucket.batch < batch || bucket.seq_len < seq_len) continue;
+        if (!best || (long)bucket.batch * bucket.seq_len < (long)best->batch * best->seq_len) {
+            best = &bucket;
+        }
+    }
+    if (!best) throw std::out_of_range("no bucket fits the requested batch/sequence length");
+    return *best;
+}
+
+// Mask keys past the valid length (and future keys for causal models).
+// Padded query rows still see the valid keys, so their softmax stays finite.
+// The MoE token mask marks the rows of the first `batch` entries up to the
+// valid length as real. A pipeline without attention (or MoE) has no mask
+// of that kind to set.
+void BucketedModel::set_valid_length(Bucket& bucket, int batch, int seq_len) {
+    if (bucket.masked_len == seq_len && bucket.masked_batch == batch) return;
+    const int S = bucket.seq_len;
+    if (bucket.pipeline.has_tensor("attn_mask") && bucket.masked_len != seq_len) {
+        float* m = static_cast<float*>(bucket.pipeline.tensor("attn_mask").get_data_handle());
+        for (int i = 0; i < S; i++) {
+            for (int j = 0; j < S; j++) {
+                bool visible = j < seq_len && (!config.causal || j <= i);
+                m[i * S + j] = visible ? 0.0f : -INFINITY;
+            }
+        }
+    }
+    if (bucket.pipeline.has_tensor("token_mask")) {
+        uint8_t* valid = static_cast<uint8_t*>(bucket.pipeline.tensor("token_mask").get_data_handle());
+        for (int b = 0; b < bucket.batch; b++) {
+            for (int s = 0; s < S; s++) valid[b * S + s] = b < batch && s < seq_len;
+        }
+    }
+    bucket.masked_len = seq_len;
+    bucket.masked_batch = batch;
+}
+
+void BucketedModel::execute(stream& strm, const float* input, float* output, int batch, int seq_len) {
+    Bucket& bucket = route(batch, seq_len);
+    const size_t H = config.hidden;
+    const size_t S = bucket.seq_len;
+
+    float* src = static_cast<float*>(bucket.pipeline.tensor("src").get_data_handle());
+    std::memset(src, 0, sizeof(float) * bucket.batch * S * H);
+    for (int b = 0; b < batch; b++) {
+        std::memcpy(src + b * S * H, input + b * seq_len * H, sizeof(float) * seq_len * H);
+    }
+    set_valid_length(bucket, batch, seq_len);
+
+    bucket.pipeline.execute(eng, strm);
+    strm.wait();
+
+    const float* out = static_cast<const float*>(bucket.pipeline.tensor(output_name).get_data_handle());
+    for (int b = 0; b < batch; b++) {
+        std::memcpy(output + b * seq_len * H, out + b * S * H, sizeof(float) * seq_len * H);
+    }
+}
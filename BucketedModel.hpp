@@ -0,0 +1,50 @@
+#ifndef BUCKETED_MODEL_HPP
+#define BUCKETED_MODEL_HPP
+
+#include "ModelBuilder.hpp"
+#include <string>
+#include <vector>
+
+// Pre-built pipelines for padded (batch, seq_len) shapes that all share one
+// set of weights. A request is routed to the smallest bucket that fits and
+// zero-padded up to it, so new shapes never trigger a rebuild and small
+// requests don't pay for the largest shape. Padded keys are masked out of
+// attention and padded rows out of the MoE expert capacity; padded rows
+// are computed and discarded.
+class BucketedModel {
+public:
+    struct Bucket {
+        int batch;
+        int seq_len;
+        PrimitivePipeline pipeline;
+        int masked_len = -1;    // valid length the masks are set up for
+        int masked_batch = -1;  // valid batch entries the token mask is set up for
+    };
+
+    // Buckets are all powers of two from 1 to max_batch and from min_seq to
+    // max_seq (both rounded up to a power of two). config.batch and
+    // config.seq_len are ignored. The output is moe_out, or block_out when
+    // config.layers leaves out the MoE layer; throws if no layer writes it.
+    BucketedModel(dnnl::engine& eng, const ModelConfig& config, int max_batch, int max_seq,
+        int min_seq = 8, PrimitiveCache& cache = PrimitiveCache::global());
+
+    // Smallest bucket holding [batch, seq_len]; throws if none does
+    Bucket& route(int batch, int seq_len);
+
+    // Run one request. input and output are dense [batch, seq_len, hidden].
+    void execute(dnnl::stream& strm, const float* input, float* output, int batch, int seq_len);
+
+    const std::vector<Bucket>& get_buckets() const { return buckets; }
+    const ModelConfig& get_config() const { return config; }
+
+private:
+    void set_valid_length(Bucket& bucket, int batch, int seq_len);
+
+    dnnl::engine eng;
+    ModelConfig config;
+    ModelWeights weights;
+    std::vector<Bucket> buckets;
+    std::string output_name;
+};
+
+#endif // BUCKETED_MODEL_HPP
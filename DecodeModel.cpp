@@ -0,0 +1,61 @@
+#include "DecodeModel.hpp"
+#include "Logging.hpp"
+#include <cstring>
+#include <stdexcept>
+
+using namespace dnnl;
+
+static KvCache::Config layer_cache_config(KvCache::Config cache_config, const ModelConfig& config) {
+    cache_config.num_layers = config.num_blocks;
+    cache_config.hidden = config.hidden;
+    return cache_config;
+}
+
+DecodeModel::DecodeModel(engine& eng, const ModelConfig& config, KvCache::Config cache_config,
+    PrimitiveCache& cache)
+    : eng(eng), config(config), kv_cache(layer_cache_config(cache_config, config)),
+      state(std::make_shared<DecodeState>()), primitive_cache(cache) {
+
+    if (!(config.layers & layer_attention)) {
+        throw std::invalid_argument("decoding needs the attention layers");
+    }
+    state->cache = &kv_cache;
+    this->config.batch = 1;
+    this->config.causal = true;
+    this->config.padding_mask = false;
+    this->config.decode = state;
+    weights = create_model_weights(eng, this->config);
+}
+
+PrimitivePipeline& DecodeModel::pipeline(int tokens) {
+    auto it = pipelines.find(tokens);
+    if (it != pipelines.end()) return it->second;
+
+    ModelConfig step_config = config;
+    step_config.seq_len = tokens;
+    LOG_DEBUG("Building decode pipeline for %d tokens\n", tokens);
+    return pipelines.emplace(tokens, build_model_pipeline(eng, step_config, weights, primitive_cache)).first->second;
+}
+
+int DecodeModel::start(const std::vector<uint64_t>& prompt_keys, int* reused_tokens) {
+    return kv_cache.create_sequence(prompt_keys, reused_tokens);
+}
+
+void DecodeModel::step(stream& strm, int seq, const float* input, int tokens, float* output,
+    const uint64_t* keys) {
+    if (tokens <= 0) throw std::invalid_argument("a decode step needs at least one token");
+    PrimitivePipeline& model = pipeline(tokens);
+    const size_t H = config.hidden;
+
+    kv_cache.reserve(seq, tokens);
+    state->seq = seq;
+
+    std::memcpy(model.tensor("src").get_data_handle(), input, sizeof(float) * tokens * H);
+    model.execute(eng, strm);
+    strm.wait();
+
+    const char* out_name = (config.layers & layer_moe) ? "moe_out" : "block_out";
+    std::memcpy(output, model.tensor(out_name).get_data_handle(), sizeof(float) * tokens * H);
+
+    kv_cache.commit(seq, tokens, keys);
+}
@@ -0,0 +1,49 @@
+#ifndef DECODE_MODEL_HPP
+#define DECODE_MODEL_HPP
+
+#include "KvCache.hpp"
+#include "ModelBuilder.hpp"
+#include <map>
+#include <memory>
+#include <vector>
+
+// Incremental (autoregressive) decoding over a paged KV cache. A step runs
+// only the new tokens of one sequence: the prompt once (prefill), then one
+// token at a time. Pipelines are built on first use for each new-token
+// count and share one set of weights; attention primitives take the
+// context length at run time, so a pipeline serves every step.
+class DecodeModel {
+public:
+    // config.batch and config.seq_len are ignored; cache_config.num_layers
+    // and hidden are taken from config
+    DecodeModel(dnnl::engine& eng, const ModelConfig& config, KvCache::Config cache_config = KvCache::Config(),
+        PrimitiveCache& cache = PrimitiveCache::global());
+
+    // Start a sequence. Returns its id and sets `reused_tokens` to the
+    // number of leading prompt tokens already in the cache; the first step
+    // should feed the prompt from there on.
+    int start(const std::vector<uint64_t>& prompt_keys, int* reused_tokens = nullptr);
+
+    // Run `tokens` new tokens of `seq`. input and output are dense
+    // [tokens, hidden]; `keys` (may be null) enable prefix reuse of the
+    // pages these tokens complete.
+    void step(dnnl::stream& strm, int seq, const float* input, int tokens, float* output,
+        const uint64_t* keys = nullptr);
+
+    void finish(int seq) { kv_cache.release_sequence(seq); }
+
+    PrimitivePipeline& pipeline(int tokens);
+    KvCache& cache() { return kv_cache; }
+    const ModelConfig& get_config() const { return config; }
+
+private:
+    dnnl::engine eng;
+    ModelConfig config;
+    ModelWeights weights;
+    KvCache kv_cache;
+    std::shared_ptr<DecodeState> state;
+    PrimitiveCache& primitive_cache;
+    std::map<int, PrimitivePipeline> pipelines;  // by new-token count
+};
+
+#endif // DECODE_MODEL_HPP
@@ -0,0 +1,277 @@
+#include "KvCache.hpp"
+#include "Logging.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace dnnl;
+
+namespace {
+
+const uint64_t hash_seed = 0x9E3779B97F4A7C15ull;
+
+// splitmix64 step over (hash, key)
+uint64_t mix(uint64_t hash, uint64_t key) {
+    uint64_t z = hash ^ (key + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2));
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return z ? z : 1;  // 0 marks an unregistered page
+}
+
+} // namespace
+
+KvCache::KvCache(const Config& config)
+    : config(config), page_floats((size_t)config.page_size * config.hidden) {
+    if (config.page_size <= 0 || config.num_pages <= 0 || config.num_layers <= 0) {
+        throw std::invalid_argument("KV cache needs positive page size, page count and layer count");
+    }
+    size_t bytes = (size_t)config.num_pages * config.num_layers * 2 * page_floats * sizeof(float);
+    bytes = (bytes + 63) / 64 * 64;
+    storage = std::shared_ptr<float>(static_cast<float*>(std::aligned_alloc(64, bytes)), std::free);
+    if (!storage) throw std::bad_alloc();
+
+    refcount.assign(config.num_pages, 0);
+    page_hash.assign(config.num_pages, 0);
+    for (int p = config.num_pages - 1; p >= 0; p--) free_pages.push_back(p);
+    LOG_INFO("KV cache: %d pages of %d tokens, %zu bytes\n", config.num_pages, config.page_size, bytes);
+}
+
+float* KvCache::page_data(int page, int layer, int kv) {
+    return storage.get() + (((size_t)page * config.num_layers + layer) * 2 + kv) * page_floats;
+}
+
+int KvCache::create_sequence(const std::vector<uint64_t>& prompt_keys, int* reused) {
+    const int P = config.page_size;
+    Sequence s;
+    s.hash = hash_seed;
+
+    // Attach cached pages for whole-page prefixes; keep at least one prompt
+    // token to run so the caller gets an output for the last position
+    const int max_pages = prompt_keys.empty() ? 0 : (int)(prompt_keys.size() - 1) / P;
+    for (int p = 0; p < max_pages; p++) {
+        uint64_t h = s.hash;
+        for (int t = p * P; t < (p + 1) * P; t++) h = mix(h, prompt_keys[t]);
+        auto it = prefix.find(h);
+        if (it == prefix.end()) break;
+        int page = it->second;
+        if (refcount[page] == 0) {
+            lru.erase(lru_pos.at(page));
+            lru_pos.erase(page);
+        }
+        refcount[page]++;
+        s.pages.push_back(page);
+        s.length += P;
+        s.hash = h;
+    }
+
+    reused_tokens += s.length;
+    if (reused) *reused = s.length;
+    int id = next_sequence++;
+    sequences[id] = s;
+    return id;
+}
+
+void KvCache::release_sequence(int seq) {
+    auto it = sequences.find(seq);
+    if (it == sequences.end()) return;
+    for (int page : it->second.pages) unref_page(page);
+    sequences.erase(it);
+}
+
+void KvCache::unref_page(int page) {
+    if (--refcount[page] > 0) return;
+    if (page_hash[page] != 0) {
+        lru_pos[page] = lru.insert(lru.end(), page);
+    } else {
+        free_pages.push_back(page);
+    }
+}
+
+int KvCache::allocate_page() {
+    int page;
+    if (!free_pages.empty()) {
+        page = free_pages.back();
+        free_pages.pop_back();
+    } else if (!lru.empty()) {
+        page = lru.front();
+        lru.pop_front();
+        lru_pos.erase(page);
+        prefix.erase(page_hash[page]);
+        page_hash[page] = 0;
+        evictions++;
+    } else {
+        throw std::runtime_error("KV cache is out of pages");
+    }
+    refcount[page] = 1;
+    return page;
+}
+
+void KvCache::reserve(int seq, int tokens) {
+    Sequence& s = sequences.at(seq);
+    if (s.length + tokens > config.max_context) {
+        throw std::length_error("sequence exceeds the KV cache context limit");
+    }
+    const size_t needed = (size_t)(s.length + tokens + config.page_size - 1) / config.page_size;
+    while (s.pages.size() < needed) s.pages.push_back(allocate_page());
+}
+
+void KvCache::commit(int seq, int tokens, const uint64_t* keys) {
+    Sequence& s = sequences.at(seq);
+    const int P = config.page_size;
+    for (int i = 0; i < tokens; i++) {
+        const int pos = s.length + i;
+        if (keys) {
+            s.hash = mix(s.hash, keys[i]);
+        } else {
+            s.keyed = false;
+        }
+        if ((pos + 1) % P == 0 && s.keyed) {
+            int page = s.pages[pos / P];
+            if (page_hash[page] == 0 && !prefix.count(s.hash)) {
+                page_hash[page] = s.hash;
+                prefix[s.hash] = page;
+            }
+        }
+    }
+    s.length += tokens;
+}
+
+void KvCache::evict_cached() {
+    for (int page : lru) {
+        prefix.erase(page_hash[page]);
+        page_hash[page] = 0;
+        free_pages.push_back(page);
+        evictions++;
+    }
+    lru.clear();
+    lru_pos.clear();
+}
+
+KvCache::Stats KvCache::stats() const {
+    const size_t page_bytes = (size_t)config.num_layers * 2 * page_floats * sizeof(float);
+    Stats s;
+    s.pages_total = config.num_pages;
+    for (int r : refcount) s.pages_in_use += r > 0;
+    s.pages_cached = lru.size();
+    s.sequences = sequences.size();
+    s.bytes_total = s.pages_total * page_bytes;
+    s.bytes_in_use = s.pages_in_use * page_bytes;
+    s.reused_tokens = reused_tokens;
+    s.evictions = evictions;
+    return s;
+}
+
+void KvCache::print_stats() const {
+    Stats s = stats();
+    printf("[KV CACHE] sequences=%zu pages: %zu in use, %zu cached, %zu total "
+        "(%.2f / %.2f MiB) reused_tokens=%zu evictions=%zu\n",
+        s.sequences, s.pages_in_use, s.pages_cached, s.pages_total,
+        s.bytes_in_use / 1048576.0, s.bytes_total / 1048576.0, s.reused_tokens, s.evictions);
+}
+
+void init_paged_attention(PagedAttention& a, PrimitiveCache& cache) {
+    const memory::dim T = a.tokens, H = a.hidden, heads = a.num_heads, D = H / heads;
+    const memory::dim L = a.state->cache->get_config().max_context;
+    const memory::dim RT = DNNL_RUNTIME_DIM_VAL;
+    const auto f32 = memory::data_type::f32;
+
+    // Q is read from the qkv rows; cached K is viewed transposed. Scores are
+    // [tokens, heads, max_context] so page i writes columns [i * P, ...).
+    auto q_md = memory::desc({heads, T, D}, f32, {D, 3 * H, 1});
+    auto key_t_md = memory::desc({heads, D, RT}, f32, {D, 1, H});
+    auto score_md = memory::desc({heads, T, RT}, f32, {L, heads * L, 1});
+    auto value_md = memory::desc({heads, RT, D}, f32, {D, H, 1});
+    auto context_md = memory::desc({heads, T, D}, f32, {D, H, 1});
+
+    AttrSpec score_attr;
+    score_attr.append_eltwise(algorithm::eltwise_linear, 1.0f / std::sqrt((float)D), 0.0f);
+    a.score_matmul = cache.get_matmul(a.eng, q_md, key_t_md, memory::desc(), score_md, score_attr).prim;
+    a.context_matmul = cache.get_matmul(a.eng, score_md, value_md, memory::desc(), context_md).prim;
+    AttrSpec accumulate;
+    accumulate.append_sum();
+    a.context_accumulate = cache.get_matmul(a.eng, score_md, value_md, memory::desc(), context_md, accumulate).prim;
+
+    a.scores.assign((size_t)T * heads * L, 0.0f);
+
+    // Page arguments for `n` tokens; K, V (and a partial page's scores)
+    // get their handles per run
+    a.query = memory(q_md, a.eng, nullptr);
+    a.context = memory(context_md, a.eng, nullptr);
+    auto add_page = [&](memory::dim n, float* score_data, std::vector<std::unordered_map<int, memory>>& score_args,
+        std::vector<std::unordered_map<int, memory>>& context_args) {
+        memory key_t(memory::desc({heads, D, n}, f32, {D, 1, H}), a.eng, nullptr);
+        memory score(memory::desc({heads, T, n}, f32, {L, heads * L, 1}), a.eng, score_data);
+        memory value(memory::desc({heads, n, D}, f32, {D, H, 1}), a.eng, nullptr);
+        score_args.push_back({{DNNL_ARG_SRC, a.query}, {DNNL_ARG_WEIGHTS, key_t}, {DNNL_ARG_DST, score}});
+        context_args.push_back({{DNNL_ARG_SRC, score}, {DNNL_ARG_WEIGHTS, value}, {DNNL_ARG_DST, a.context}});
+    };
+    const memory::dim P = a.state->cache->get_config().page_size;
+    for (memory::dim i = 0; i < (L + P - 1) / P; i++) {
+        add_page(P, a.scores.data() + i * P, a.page_score_args, a.page_context_args);
+    }
+    for (memory::dim n = 1; n < P; n++) add_page(n, nullptr, a.tail_score_args, a.tail_context_args);
+}
+
+void execute_paged_attention(PagedAttention& a, stream& strm, const CustomOp::Args& args) {
+    KvCache& kv = *a.state->cache;
+    const int seq = a.state->seq;
+    const int T = a.tokens, H = a.hidden, heads = a.num_heads;
+    const int P = kv.get_config().page_size;
+    const memory::dim Lmax = kv.get_config().max_context;
+    const int start = kv.length(seq);
+    const int L = start + T;
+    const auto& pages = kv.pages(seq);
+
+    // Append the new tokens' K and V rows
+    const memory& qkv_mem = args.at(DNNL_ARG_MULTIPLE_SRC);
+    const memory& attn_out = args.at(DNNL_ARG_MULTIPLE_DST);
+    const float* qkv = static_cast<const float*>(qkv_mem.get_data_handle());
+    for (int t = 0; t < T; t++) {
+        const int pos = start + t;
+        const int page = pages[pos / P], slot = pos % P;
+        std::memcpy(kv.key_page(page, a.layer) + (size_t)slot * H, qkv + (size_t)t * 3 * H + H, sizeof(float) * H);
+        std::memcpy(kv.value_page(page, a.layer) + (size_t)slot * H, qkv + (size_t)t * 3 * H + 2 * H, sizeof(float) * H);
+    }
+
+    // Scores against every cached page
+    a.query.set_data_handle(qkv_mem.get_data_handle());
+    const int num_pages = (L + P - 1) / P;
+    for (int i = 0; i < num_pages; i++) {
+        const int n = std::min(P, L - i * P);
+        auto& page_args = n == P ? a.page_score_args[i] : a.tail_score_args[n - 1];
+        page_args.at(DNNL_ARG_WEIGHTS).set_data_handle(kv.key_page(pages[i], a.layer));
+        if (n < P) page_args.at(DNNL_ARG_DST).set_data_handle(a.scores.data() + (size_t)i * P);
+        a.score_matmul.execute(strm, page_args);
+    }
+    strm.wait();
+
+    // Causal softmax: token t sees positions [0, start + t]
+    for (int t = 0; t < T; t++) {
+        const int visible = start + t + 1;
+        for (int h = 0; h < heads; h++) {
+            float* row = a.scores.data() + ((size_t)t * heads + h) * Lmax;
+            float max_score = *std::max_element(row, row + visible);
+            float sum = 0.0f;
+            for (int j = 0; j < visible; j++) {
+                row[j] = std::exp(row[j] - max_score);
+                sum += row[j];
+            }
+            for (int j = 0; j < visible; j++) row[j] /= sum;
+            std::fill(row + visible, row + L, 0.0f);
+        }
+    }
+
+    // Context, accumulated page by page into attn_out
+    a.context.set_data_handle(attn_out.get_data_handle());
+    for (int i = 0; i < num_pages; i++) {
+        const int n = std::min(P, L - i * P);
+        auto& page_args = n == P ? a.page_context_args[i] : a.tail_context_args[n - 1];
+        page_args.at(DNNL_ARG_WEIGHTS).set_data_handle(kv.value_page(pages[i], a.layer));
+        (i == 0 ? a.context_matmul : a.context_accumulate).execute(strm, page_args);
+    }
+    strm.wait();
+}
@@ -0,0 +1,141 @@
+#ifndef KV_CACHE_HPP
+#define KV_CACHE_HPP
+
+#include "oneapi/dnnl/dnnl.hpp"
+#include "PrimitiveCache.hpp"
+#include "PrimitivePipeline.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Paged K/V storage for incremental decoding. All memory is allocated up
+// front as `num_pages` pages; a page holds `page_size` tokens of K and V
+// for every layer ([page_size, hidden] each). A sequence owns a list of
+// pages and grows one page at a time.
+//
+// Full pages can be shared: when a sequence fills a page it is registered
+// under a hash of all token keys up to its end, and a later sequence whose
+// prompt starts with the same keys attaches it instead of recomputing it.
+// Released pages that are registered stay cached until their memory is
+// needed (least recently used first).
+//
+// Not thread safe; one decoder drives a cache.
+class KvCache {
+public:
+    struct Config {
+        int num_layers = 1;
+        int hidden = 768;
+        int page_size = 16;
+        int num_pages = 256;
+        int max_context = 2048;  // tokens per sequence
+    };
+
+    struct Stats {
+        size_t pages_total = 0;
+        size_t pages_in_use = 0;   // referenced by a live sequence
+        size_t pages_cached = 0;   // only kept for prefix reuse
+        size_t sequences = 0;
+        size_t bytes_total = 0;
+        size_t bytes_in_use = 0;
+        size_t reused_tokens = 0;  // prompt tokens served from cached pages
+        size_t evictions = 0;
+    };
+
+    explicit KvCache(const Config& config);
+
+    // Start a sequence whose prompt has `prompt_keys` (e.g. token ids).
+    // Cached pages matching a prefix of the prompt are attached; returns the
+    // sequence id and sets `reused_tokens` to the number of prompt tokens
+    // that need no recomputation (at least one token is always left).
+    int create_sequence(const std::vector<uint64_t>& prompt_keys, int* reused_tokens = nullptr);
+    void release_sequence(int seq);
+
+    // Make room for `tokens` more tokens of `seq`, evicting cached pages if
+    // needed. Throws when the context limit or the page pool is exceeded.
+    void reserve(int seq, int tokens);
+    // Mark `tokens` reserved tokens as written. `keys` (may be null) are
+    // their prefix keys; pages they complete become reusable.
+    void commit(int seq, int tokens, const uint64_t* keys = nullptr);
+
+    // Drop every cached page that no sequence uses
+    void evict_cached();
+
+    int length(int seq) const { return sequences.at(seq).length; }
+    const std::vector<int>& pages(int seq) const { return sequences.at(seq).pages; }
+    float* key_page(int page, int layer) { return page_data(page, layer, 0); }
+    float* value_page(int page, int layer) { return page_data(page, layer, 1); }
+    const Config& get_config() const { return config; }
+
+    Stats stats() const;
+    void print_stats() const;
+
+private:
+    struct Sequence {
+        std::vector<int> pages;
+        int length = 0;
+        uint64_t hash = 0;      // chain hash of the keys committed so far
+        bool keyed = true;      // every committed token had a key
+    };
+
+    float* page_data(int page, int layer, int kv);
+    int allocate_page();
+    void unref_page(int page);
+
+    Config config;
+    size_t page_floats;  // floats in one K or V block of one layer
+    std::shared_ptr<float> storage;
+    std::vector<int> refcount;
+    std::vector<uint64_t> page_hash;  // 0 = not registered
+    std::vector<int> free_pages;
+    std::list<int> lru;               // cached unreferenced pages, oldest first
+    std::unordered_map<int, std::list<int>::iterator> lru_pos;
+    std::unordered_map<uint64_t, int> prefix;  // chain hash -> page
+    std::unordered_map<int, Sequence> sequences;
+    int next_sequence = 0;
+    size_t reused_tokens = 0;
+    size_t evictions = 0;
+};
+
+// Tells the attention ops of a decode pipeline which sequence they run.
+// The caller sets `seq` and reserves room before every execute.
+struct DecodeState {
+    KvCache* cache = nullptr;
+    int seq = -1;
+};
+
+// Attention of `tokens` new tokens against the cached prefix of one layer.
+// The new K/V rows are appended to the sequence's pages, then scores and
+// context are computed page by page with runtime-N/K matmuls, so one set
+// of primitives serves every context length.
+struct PagedAttention {
+    std::shared_ptr<DecodeState> state;
+    int layer = 0;
+    int tokens = 0;
+    int hidden = 0;
+    int num_heads = 0;
+
+    dnnl::engine eng;
+
+    dnnl::primitive score_matmul;    // Q * K_page^T, scaled
+    dnnl::primitive context_matmul;  // P_page * V_page
+    dnnl::primitive context_accumulate;  // same with a sum post-op
+    std::vector<float> scores;       // [tokens, heads, max_context]
+
+    // Arguments built once by init, so a run only points them at the
+    // sequence's pages: one set per page position for full pages, and one
+    // per token count (1 .. page_size - 1) for a partial last page. A
+    // page's scores are the score matmul's dst and the context matmul's src.
+    dnnl::memory query, context;  // views of qkv / attn_out, set per run
+    std::vector<std::unordered_map<int, dnnl::memory>> page_score_args, page_context_args;
+    std::vector<std::unordered_map<int, dnnl::memory>> tail_score_args, tail_context_args;
+};
+
+void init_paged_attention(PagedAttention& a, PrimitiveCache& cache);
+// Custom-op kernel: reads qkv [tokens, 3 * hidden] (DNNL_ARG_MULTIPLE_SRC)
+// and writes attn_out [tokens, hidden] (DNNL_ARG_MULTIPLE_DST)
+void execute_paged_attention(PagedAttention& a, dnnl::stream& strm, const CustomOp::Args& args);
+
+#endif // KV_CACHE_HPP
@@ -0,0 +1,46 @@
+#ifndef LOGGING_HPP
+#define LOGGING_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Log levels. The runtime level comes from the MODEL_LOG_LEVEL environment
+// variable (none/error/warn/info/debug, default warn) or set_log_level().
+// Messages above MODEL_LOG_MAX_LEVEL are compiled out entirely, e.g. build
+// with -DMODEL_LOG_MAX_LEVEL=1 to keep only errors.
+enum class LogLevel { none = 0, error = 1, warn = 2, info = 3, debug = 4 };
+
+#ifndef MODEL_LOG_MAX_LEVEL
+#define MODEL_LOG_MAX_LEVEL 4
+#endif
+
+inline LogLevel& log_level_storage() {
+    static LogLevel level = [] {
+        const char* env = std::getenv("MODEL_LOG_LEVEL");
+        if (!env) return LogLevel::warn;
+        const char* names[] = {"none", "error", "warn", "info", "debug"};
+        for (int i = 0; i < 5; i++) {
+            if (std::strcmp(env, names[i]) == 0) return static_cast<LogLevel>(i);
+        }
+        return LogLevel::warn;
+    }();
+    return level;
+}
+
+inline LogLevel log_level() { return log_level_storage(); }
+inline void set_log_level(LogLevel level) { log_level_storage() = level; }
+
+#define MODEL_LOG(level, tag, ...) \
+    do { \
+        if (static_cast<int>(level) <= MODEL_LOG_MAX_LEVEL && log_level() >= (level)) { \
+            std::printf("[" tag "] " __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_ERROR(...) MODEL_LOG(LogLevel::error, "ERROR", __VA_ARGS__)
+#define LOG_WARN(...) MODEL_LOG(LogLevel::warn, "WARN", __VA_ARGS__)
+#define LOG_INFO(...) MODEL_LOG(LogLevel::info, "INFO", __VA_ARGS__)
+#define LOG_DEBUG(...) MODEL_LOG(LogLevel::debug, "DEBUG", __VA_ARGS__)
+
+#endif // LOGGING_HPP
@@ -1,13 +1,25 @@
 #include "ModelBuilder.hpp"  // Ensure this file exists
+#include "Affinity.hpp"
+#include "KvCache.hpp"
+#include "Logging.hpp"
+#include "MoeDispatch.hpp"
+#include "OpGraph.hpp"
+#include "ThreadPool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <map>
+#include <memory>
 #include <vector>
 #include <iostream>
 #include "oneapi/dnnl/dnnl.hpp"
 #include "example_utils.hpp"
 #include <iostream>
-#include <queue>
 #include <utility>
 #include <dnnl.hpp>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 using namespace dnnl;
@@ -24,317 +36,748 @@ memory::format_tag get_format_tag(const std::vector<long>& dims) {
     }
 }
 
-// Helper function to initialize memory objects
-std::map<std::string, memory> initialize_memory_objects(
+// Helper function to create memory objects. Contents are left to the
+// caller (init_memory or the ops that write them).
+std::map<std::string, memory> create_memory_objects(
     engine& eng, 
-    const std::map<std::string, memory::dims>& tensor_shapes, 
-    std::map<std::string, std::vector<float>>& tensor_data) {
+    const std::map<std::string, memory::dims>& tensor_shapes) {
     
     std::map<std::string, memory> memory_objects;
 
     for (const auto& [name, dims] : tensor_shapes) {
-        std::cout << "Initializing memory for " << name << " tensor" << " with dims: ";
-        for (auto dim : dims) {
-            std::cout << dim << " ";
+        if (log_level() >= LogLevel::debug) {
+            std::string dims_str;
+            for (auto dim : dims) {
+                dims_str += std::to_string(dim) + " ";
+            }
+            LOG_DEBUG("Creating memory for %s tensor with dims: %s\n", name.c_str(), dims_str.c_str());
         }
-        std::cout << std::endl;
         auto format_tag = get_format_tag(dims);
         auto mem_desc = create_memory_desc(dims, format_tag);
-        // printf("Memory initialized\n"); 
-        memory_objects[name] = initialize_memory(mem_desc, eng, tensor_data[name]);
+        memory_objects[name] = memory(mem_desc, eng);
     }
 
     return memory_objects;
 }
 
-// Helper function to allocate and fill tensor data
-std::map<std::string, std::vector<float>> allocate_and_initialize_tensors(
-    const std::map<std::string, memory::dims>& tensor_shapes) {
-    
-    std::map<std::string, std::vector<float>> tensor_data;
-    
-    for (const auto& [name, dims] : tensor_shapes) {
-        tensor_data[name] = std::vector<float>(product(dims));
-        fill_random_data(tensor_data[name]);
+// Helper function for a tensor's initializer: Xavier for weight matrices,
+// zero biases and LayerNorm shifts, unit LayerNorm scales, uniform [0, 1)
+// otherwise. Each name gets its own stream.
+InitSpec init_spec(const std::string& name, uint64_t seed) {
+    InitSpec spec;
+    if (name.find("weight") != std::string::npos) {
+        spec.kind = InitKind::xavier_uniform;
+    } else if (name.find("bias") != std::string::npos || name.find("beta") != std::string::npos) {
+        spec.kind = InitKind::constant;
+        spec.a = 0.0f;
+    } else if (name.find("gamma") != std::string::npos) {
+        spec.kind = InitKind::constant;
+        spec.a = 1.0f;
     }
+    spec.seed = seed;
+    spec.stream = init_stream_id(name);
+    return spec;
+}
 
-    return tensor_data;
+// Helper function to swap a weight for a copy in the layout a primitive
+// prefers. Runs once at build time; only the reordered copy stays resident.
+void use_preferred_weights(engine& eng, std::map<std::string, memory>& memory_objects,
+    const std::string& name, const memory::desc& preferred) {
+    memory_objects[name] = reorder_memory(memory_objects.at(name), preferred, eng);
 }
 
+// Helper function for the attributes every primitive in `model` starts from
+AttrSpec base_attr(const PrimitivePipeline& model, const ModelConfig& config) {
+    AttrSpec attr;
+    if (model.shared_scratchpad()) attr.scratchpad = scratchpad_mode::user;
+    attr.threads = config.threads;
+    return attr;
+}
 
-// Helper function to define tensor dimensions
-std::map<std::string, memory::dims> define_tensor_shapes() {
-    return {
-        {"src", {1, 12, 768}},
-        {"query", {1, 12, 768}},
-        {"key", {1, 12, 768}},
-        {"value", {1, 12, 768}},
-        {"weight_q", {1, 768, 768}},
-        {"weight_k", {1, 768, 768}},
-        {"weight_v", {1, 768, 768}},
-        {"weight_o", {1, 768, 768}},
-        {"ffn_weight1", {1, 768, 3072}},
-        {"ffn_weight2", {1, 3072, 768}},
-        {"ffn_bias1", {1, 1, 3072}},
-        {"ffn_bias2", {1, 1, 768}},
-        {"attn_out", {1, 12, 768}},
-        {"ffn_out", {1, 12, 3072}},
-        {"gate_weight", {1, 768, 4}},
-        {"gate_out", {1, 12, 4}},
-        {"expert_weight0", {1, 768, 768}},
-        {"expert_bias0", {1, 1, 768}},
-        {"expert_out0", {1, 12, 768}},
-        {"expert_weight1", {1, 768, 768}},
-        {"expert_bias1", {1, 1, 768}},
-        {"expert_out1", {1, 12, 768}},
-        {"expert_weight2", {1, 768, 768}},
-        {"expert_bias2", {1, 1, 768}},
-        {"expert_out2", {1, 12, 768}},
-        {"expert_weight3", {1, 768, 768}},
-        {"expert_bias3", {1, 1, 768}},
-        {"expert_out3", {1, 12, 768}},
-        {"moe_out", {1, 12, 768}}
-    };
+// Helper function for the u8 parameters of an int8 op's input
+QuantParams input_quant_params(const ModelConfig& config, const std::string& op_name) {
+    if (config.precision != Precision::int8) return QuantParams();
+    auto it = config.calibration.find(op_name);
+    if (it == config.calibration.end()) {
+        throw std::invalid_argument("int8 model has no calibration range for " + op_name);
+    }
+    return u8_params_from_range(it->second.first, it->second.second);
 }
-        
 
-// Self-Attention Layer
-void build_attention_layer(engine& eng, std::map<std::string, memory>& memory_objects, PrimitivePipeline& model) {
-    PrimitivePipeline attention_pipeline;
-    
-    // Query, Key, Value MatMul
-    std::vector<std::string> qkv = {"query", "key", "value"};
-    for (const auto& name : qkv) {
-        auto matmul_pd = matmul::primitive_desc(eng, 
-            memory_objects.at("src").get_desc(),
-            memory_objects.at("weight_" + name.substr(0, 1)).get_desc(),
-            memory_objects.at(name).get_desc()
-        );
-        model.insert({matmul(matmul_pd), {
-            {DNNL_ARG_SRC, memory_objects.at("src")},
-            {DNNL_ARG_WEIGHTS, memory_objects.at("weight_" + name.substr(0, 1))},
-            {DNNL_ARG_DST, memory_objects.at(name)}
-        }});
-    }
-    printf("Softmax executed\n");
-    // Scaled Dot-Product Attention (softmax on Q*K^T, multiply by V)
-    // Implement softmax separately in a real case
-    // auto attn_matmul_pd = matmul::primitive_desc(eng,
-    //     memory_objects.at("query").get_desc(),
-    //     memory_objects.at("key").get_desc(),
-    //     memory_objects.at("attn_out").get_desc()
-    // );
-    // model.insert({matmul(attn_matmul_pd), {
-    //     {DNNL_ARG_SRC, memory_objects.at("query")},
-    //     {DNNL_ARG_WEIGHTS, memory_objects.at("key")},
-    //     {DNNL_ARG_DST, memory_objects.at("attn_out")}
-    // }});
-
-    auto softmax_pd = softmax_forward::primitive_desc(eng,
-        prop_kind::forward_inference, algorithm::softmax_accurate, memory_objects.at("attn_out").get_desc(),
-        memory_objects.at("attn_out").get_desc(), /* axis = */ memory_objects.at("attn_out").get_desc().get_ndims() - 1 );
-    
-    auto attn_softmax_pd = softmax_forward(softmax_pd);
-        
-    model.insert({attn_softmax_pd, {
-        {DNNL_ARG_SRC, memory_objects.at("attn_out")},
-        {DNNL_ARG_DST, memory_objects.at("attn_out")}
-    }});
+// Helper function to convert a weight matmul's f32 input to the model's
+// precision. Inserts a reorder into "<op>_qin" and returns that tensor; in
+// f32 mode returns the input itself.
+memory convert_input(engine& eng, std::map<std::string, memory>& memory_objects, PrimitivePipeline& model,
+    PrimitiveCache& cache, const ModelConfig& config, const std::string& op_name, const memory& src) {
+    if (config.precision == Precision::f32) return src;
+
+    const std::string name = op_name + "_qin";
+    auto dims = src.get_desc().get_dims();
+    auto q_md = create_memory_desc(dims, get_format_tag(dims), input_data_type(config.precision));
+    memory_objects[name] = memory(q_md, eng);
+
+    AttrSpec attr = base_attr(model, config);
+    std::unordered_map<int, memory> args = {
+        {DNNL_ARG_FROM, src},
+        {DNNL_ARG_TO, memory_objects.at(name)}
+    };
+    if (config.precision == Precision::int8) {
+        // A dst scale divides: q = x / scale + zero_point
+        QuantParams q = input_quant_params(config, op_name);
+        attr.scales = {{DNNL_ARG_DST, 0}};
+        attr.zero_points = {{DNNL_ARG_DST, 0}};
+        args[DNNL_ARG_ATTR_SCALES | DNNL_ARG_DST] = make_scale(q.scale, eng);
+        args[DNNL_ARG_ATTR_ZERO_POINTS | DNNL_ARG_DST] = make_zero_point(q.zero_point, eng);
+    }
+    auto convert = cache.get_reorder(eng, src.get_desc(), q_md, attr);
+    model.insert(convert, args, op_name + "_convert");
+    return memory_objects.at(name);
+}
 
-    
-    // auto attn_matmul2_pd = matmul::primitive_desc(eng,
-    //     memory_objects.at("attn_out").get_desc(),
-    //     memory_objects.at("value").get_desc(),
-    //     memory_objects.at("src").get_desc()
-    // );
-    // model.insert({matmul(attn_matmul2_pd), {
-    //     {DNNL_ARG_SRC, memory_objects.at("attn_out")},
-    //     {DNNL_ARG_WEIGHTS, memory_objects.at("value")},
-    //     {DNNL_ARG_DST, memory_objects.at("src")}
-    // }});
-    
-    // return attention_pipeline;
+// Helper function to quantize a weight to s8 once. The per-channel scales
+// are kept as "<weight>_scales"; a weight that is already s8 is left as is.
+void quantize_weight(engine& eng, std::map<std::string, memory>& memory_objects, const std::string& name) {
+    if (memory_objects.at(name).get_desc().get_data_type() == memory::data_type::s8) return;
+    memory scales;
+    memory_objects[name] = quantize_weights_s8(memory_objects.at(name), eng, scales);
+    memory_objects[name + "_scales"] = scales;
 }
 
-// Feedforward Network (FFN)
-void build_ffn_layer(engine& eng, std::map<std::string, memory>& memory_objects, PrimitivePipeline& model) {
-    PrimitivePipeline ffn_pipeline;
-    
-    // First MatMul + ReLU
-    primitive_attr matmul_attr;
-    post_ops matmul_post_ops;
-    matmul_post_ops.append_eltwise(algorithm::eltwise_relu, 1.0f, 0.0f);
-    matmul_attr.set_post_ops(matmul_post_ops);
-    
-    auto ffn1_pd = matmul::primitive_desc(eng, 
-        memory_objects.at("src").get_desc(),
-        memory_objects.at("ffn_weight1").get_desc(),
-        memory_objects.at("ffn_out").get_desc(),
-        matmul_attr
-    );
-    model.insert({matmul(ffn1_pd), {
-        {DNNL_ARG_SRC, memory_objects.at("attn_out")},
-        {DNNL_ARG_WEIGHTS, memory_objects.at("ffn_weight1")},
-        {DNNL_ARG_BIAS, memory_objects.at("ffn_bias1")},
-        {DNNL_ARG_DST, memory_objects.at("ffn_out")}
-    }});
-    
-    // Second MatMul
-    auto ffn2_pd = matmul::primitive_desc(eng, 
-        memory_objects.at("ffn_out").get_desc(),
-        memory_objects.at("ffn_weight2").get_desc(),
-        memory_objects.at("src").get_desc()
+// Helper function for a matmul against a model weight (dst = src * weight)
+// in the model's precision. The weight is converted/quantized and reordered
+// once; dst stays f32 so the ops after it don't change. `bias_name` may be
+// empty; `args` holds any extra arguments (post-op inputs, ...).
+CachedPrimitive insert_weight_matmul(engine& eng, std::map<std::string, memory>& memory_objects,
+    PrimitivePipeline& model, PrimitiveCache& cache, const ModelConfig& config,
+    const std::string& op_name, const std::string& src_name, const std::string& weight_name,
+    const std::string& dst_name, const std::string& bias_name, AttrSpec attr,
+    std::unordered_map<int, memory> args = {}) {
+
+    memory src = convert_input(eng, memory_objects, model, cache, config, op_name, memory_objects.at(src_name));
+    if (config.precision == Precision::int8) {
+        quantize_weight(eng, memory_objects, weight_name);
+        QuantParams q = input_quant_params(config, op_name);
+        const int wei_ndims = memory_objects.at(weight_name).get_desc().get_ndims();
+        attr.scales = {{DNNL_ARG_SRC, 0}, {DNNL_ARG_WEIGHTS, 1 << (wei_ndims - 1)}};
+        attr.zero_points = {{DNNL_ARG_SRC, 0}};
+        args[DNNL_ARG_ATTR_SCALES | DNNL_ARG_SRC] = make_scale(q.scale, eng);
+        args[DNNL_ARG_ATTR_ZERO_POINTS | DNNL_ARG_SRC] = make_zero_point(q.zero_point, eng);
+        args[DNNL_ARG_ATTR_SCALES | DNNL_ARG_WEIGHTS] = memory_objects.at(weight_name + "_scales");
+    }
+
+    auto wei_dims = memory_objects.at(weight_name).get_desc().get_dims();
+    auto mm = cache.get_matmul(eng,
+        src.get_desc(),
+        memory::desc(wei_dims, weight_data_type(config.precision), memory::format_tag::any),
+        bias_name.empty() ? memory::desc() : memory_objects.at(bias_name).get_desc(),
+        memory_objects.at(dst_name).get_desc(),
+        attr
     );
-    model.insert({matmul(ffn2_pd), {
-        {DNNL_ARG_SRC, memory_objects.at("ffn_out")},
-        {DNNL_ARG_WEIGHTS, memory_objects.at("ffn_weight2")},
-        {DNNL_ARG_BIAS, memory_objects.at("ffn_bias2")},
-        {DNNL_ARG_DST, memory_objects.at("src")}
-    }});
-    
-    // return ffn_pipeline;
+    // The reorder also converts f32 weights to bf16
+    use_preferred_weights(eng, memory_objects, weight_name, mm.pd.weights_desc(0));
+
+    if (!bias_name.empty()) args[DNNL_ARG_BIAS] = memory_objects.at(bias_name);
+    args[DNNL_ARG_SRC] = src;
+    args[DNNL_ARG_WEIGHTS] = memory_objects.at(weight_name);
+    args[DNNL_ARG_DST] = memory_objects.at(dst_name);
+    model.insert(mm, args, op_name);
+    return mm;
 }
 
-std::vector<std::vector<int>> select_top_k_experts_per_token(
-    const std::vector<float>& gating_scores, int num_tokens, int num_experts, int k) {
+// Helper function to tell intermediates from weights and pipeline inputs/outputs.
+// Views (query/key/value) are not listed; they move with the tensor they view.
+bool is_activation(const std::string& name) {
+    static const std::vector<std::string> activations = {
+        "qkv", "attn_scores", "attn_out", "resid", "ln_out", "ffn_out", "ffn_gate_up", "gate_out", "expert_in", "expert_out"
+    };
+    for (const auto& prefix : activations) {
+        if (name.compare(0, prefix.size(), prefix) == 0) return true;
+    }
+    // Converted inputs of weight matmuls
+    const std::string suffix = "_qin";
+    return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
 
-    std::vector<std::vector<int>> top_k_experts_per_token(num_tokens);
+// Helper function for the row views build_ffn_layer made of `base`
+// ("tile<i>.<base>"), which a bound tensor must carry along
+std::vector<memory> tile_views(const std::map<std::string, memory>& memory_objects, const std::string& base) {
+    std::vector<memory> views;
+    const std::string suffix = "." + base;
+    for (const auto& [name, mem] : memory_objects) {
+        if (name.compare(0, 4, "tile") == 0 && name.size() > suffix.size()
+            && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            views.push_back(mem);
+        }
+    }
+    return views;
+}
 
-    for (int token_idx = 0; token_idx < num_tokens; token_idx++) {
-        std::priority_queue<std::pair<float, int>> max_heap;
+// Helper function for the name of a per-block tensor or op. Block 0 keeps
+// the plain name, so single-block models name things as before.
+std::string block_name(int block, const std::string& name) {
+    return block == 0 ? name : "block" + std::to_string(block) + "." + name;
+}
 
-        int offset = token_idx * num_experts;  
-        for (int i = 0; i < num_experts; i++) {
-            max_heap.push({gating_scores[offset + i], i});
-        }
+// Helper function for the FFN tile height: config.ffn_tile_rows, or 0 when
+// the FFN runs untiled (no tiling asked for, or one tile would cover it)
+int ffn_tile_rows(const ModelConfig& config) {
+    const int rows = config.batch * config.seq_len;
+    return config.ffn_tile_rows > 0 && config.ffn_tile_rows < rows ? config.ffn_tile_rows : 0;
+}
 
-        for (int i = 0; i < k; i++) {
-            top_k_experts_per_token[token_idx].push_back(max_heap.top().second);
-            max_heap.pop();
+// Helper function to define weight dimensions. Weights depend only on the
+// model's widths, so pipelines for different batch/sequence shapes share them.
+std::map<std::string, memory::dims> define_weight_shapes(const ModelConfig& config) {
+    const memory::dim H = config.hidden, F = config.ffn_hidden, E = config.num_experts;
+    std::map<std::string, memory::dims> shapes = {
+        {"gate_weight", {1, H, E}}
+    };
+    for (int b = 0; b < config.num_blocks; b++) {
+        shapes[block_name(b, "weight_qkv")] = {1, H, 3 * H};  // [W_q | W_k | W_v]
+        shapes[block_name(b, "weight_o")] = {1, H, H};
+        if (config.ffn_activation == FfnActivation::swiglu) {
+            shapes[block_name(b, "ffn_weight13")] = {2, H, F};  // [W1; W3]
+            shapes[block_name(b, "ffn_bias13")] = {2, 1, F};    // [b1; b3]
+        } else {
+            shapes[block_name(b, "ffn_weight1")] = {1, H, F};
+            shapes[block_name(b, "ffn_bias1")] = {1, 1, F};
         }
+        shapes[block_name(b, "ffn_weight2")] = {1, F, H};
+        shapes[block_name(b, "ffn_bias2")] = {1, 1, H};
+        shapes[block_name(b, "ln1_gamma")] = {H};
+        shapes[block_name(b, "ln1_beta")] = {H};
+        shapes[block_name(b, "ln2_gamma")] = {H};
+        shapes[block_name(b, "ln2_beta")] = {H};
     }
-
-    return top_k_experts_per_token;
+    if (config.pre_norm) {
+        shapes["final_ln_gamma"] = {H};
+        shapes["final_ln_beta"] = {H};
+    }
+    for (int e = 0; e < config.num_experts; e++) {
+        std::string idx = std::to_string(e);
+        shapes["expert_weight" + idx] = {H, H};
+        shapes["expert_bias" + idx] = {1, H};
+    }
+    return shapes;
 }
 
+// Helper function to define activation dimensions for one (batch, seq_len)
+std::map<std::string, memory::dims> define_activation_shapes(const ModelConfig& config) {
+    const memory::dim B = config.batch, S = config.seq_len, H = config.hidden;
+    std::map<std::string, memory::dims> shapes = {
+        {"src", {B, S, H}},
+        {"qkv", {B, S, 3 * H}},
+        {"attn_out", {B, S, H}},
+        {"resid", {B, S, H}},
+        {"ln_out", {B, S, H}},
+        {"gate_out", {B, S, config.num_experts}},
+        {"moe_out", {B, S, H}}
+    };
+    // The FFN intermediate holds one tile of rows when tiled, else all of
+    // them. SwiGLU's holds the gate and up projections one after the other.
+    const memory::dim tile = ffn_tile_rows(config);
+    if (config.ffn_activation == FfnActivation::swiglu) {
+        shapes["ffn_gate_up"] = {2, tile ? tile : B * S, config.ffn_hidden};
+    } else {
+        shapes["ffn_out"] = tile ? memory::dims{1, tile, config.ffn_hidden} : memory::dims{B, S, config.ffn_hidden};
+    }
+    // Decode attention keeps its scores per step, not per activation set
+    if (!config.decode) shapes["attn_scores"] = {B, config.num_heads, S, S};
+    for (int e = 0; e < config.num_experts; e++) {
+        std::string idx = std::to_string(e);
+        shapes["expert_in" + idx] = {B * S, H};
+        shapes["expert_out" + idx] = {B * S, H};
+    }
+    return shapes;
+}
+        
 
-void build_moe_layer(engine& eng, std::map<std::string, memory>& memory_objects, 
-    int num_experts, int k, PrimitivePipeline& model) {
-
-    printf("[DEBUG] Starting MoE Layer Construction\n");
+// Self-Attention sub-block: output = input + Attention(norm(input)) * W_o
+//
+// One [hidden, 3 * hidden] matmul produces Q|K|V side by side in `qkv`.
+// Heads are split by strided views over `qkv` (no copies), so Q*K^T and
+// P*V are batched over (batch, head). P*V writes through a strided view of
+// `attn_out`, which merges the heads back into [batch, seq, hidden]. The
+// scale, mask and residual add are separate graph ops; fusion folds them
+// into the matmuls. LayerNorm runs before the QKV projection (pre-norm) or
+// on the output (post-norm).
+//
+// With config.decode the inputs are only the new tokens: their K/V rows go
+// to the KV cache and attention runs against the cached prefix (one custom
+// op, see PagedAttention); the projections and residual stay as above.
+void build_attention_layer(engine& eng, std::map<std::string, memory>& memory_objects, OpGraph& graph,
+    PrimitivePipeline& model, PrimitiveCache& cache, const ModelConfig& config, int block,
+    const std::string& input, const std::string& output) {
+
+    auto src_dims = memory_objects.at(input).get_desc().get_dims();
+    const memory::dim B = src_dims[0], S = src_dims[1], H = src_dims[2];
+    const int num_heads = config.num_heads;
+    const memory::dim D = H / num_heads;
+    if (D * num_heads != H) {
+        throw std::invalid_argument("hidden size must be divisible by num_heads");
+    }
+    auto name = [block](const std::string& n) { return block_name(block, n); };
 
-    if (k > num_experts) {
-        printf("[ERROR] k (%d) cannot be greater than num_experts (%d)\n", k, num_experts);
-        throw std::invalid_argument("k cannot be greater than num_experts");
+    std::string attn_in = input;
+    if (config.pre_norm) {
+        graph.layer_norm(name("ln1"), input, name("ln1_gamma"), name("ln1_beta"), "ln_out", config.layer_norm_eps);
+        attn_in = "ln_out";
     }
 
-    dnnl::stream s(eng);
+    // Fused Q/K/V projection: the input is read once
+    graph.weight_matmul(name("qkv_proj"), attn_in, name("weight_qkv"), "qkv");
+
+    if (config.decode) {
+        if (B != 1) throw std::invalid_argument("decode runs one sequence (batch 1)");
+        auto attn = std::make_shared<PagedAttention>();
+        attn->state = config.decode;
+        attn->layer = block;
+        attn->tokens = (int)S;
+        attn->hidden = (int)H;
+        attn->num_heads = num_heads;
+        attn->eng = eng;
+        init_paged_attention(*attn, cache);
+        graph.custom(name("attn_decode"), make_custom_op<PagedAttention, execute_paged_attention>(attn),
+            {"qkv"}, {"attn_out"});
+        graph.weight_matmul(name("attn_proj"), "attn_out", name("weight_o"), output);
+        graph.binary(name("attn_residual"), output, input, output, algorithm::binary_add);
+        if (!config.pre_norm) {
+            graph.layer_norm(name("ln1"), output, name("ln1_gamma"), name("ln1_beta"), output, config.layer_norm_eps);
+        }
+        return;
+    }
 
-    // Gating mechanism (MatMul)
-    auto gate_pd = matmul::primitive_desc(eng, 
-        memory_objects.at("src").get_desc(),
-        memory_objects.at("gate_weight").get_desc(),
-        memory_objects.at("gate_out").get_desc()
-    );
+    // Per-head views into qkv, [B, heads, S, D]; K is viewed transposed.
+    // Blocks share the activations, so the views and mask are made once.
+    if (!memory_objects.count("query")) {
+        const memory::dim row = 3 * H;
+        auto head_md = memory::desc({B, num_heads, S, D}, memory::data_type::f32, {S * row, D, row, 1});
+        auto key_t_md = memory::desc({B, num_heads, D, S}, memory::data_type::f32, {S * row, D, 1, row});
+        auto& qkv = memory_objects.at("qkv");
+        memory_objects["query"] = create_view(qkv, head_md, 0);
+        memory_objects["key"] = create_view(qkv, key_t_md, H * sizeof(float));
+        memory_objects["value"] = create_view(qkv, head_md, 2 * H * sizeof(float));
+
+        auto context_md = memory::desc({B, num_heads, S, D}, memory::data_type::f32, {S * H, D, H, 1});
+        memory_objects["attn_context"] = create_view(memory_objects.at("attn_out"), context_md, 0);
+    }
 
-    model.insert({matmul(gate_pd), {
-        {DNNL_ARG_SRC, memory_objects.at("src")},
-        {DNNL_ARG_WEIGHTS, memory_objects.at("gate_weight")},
-        {DNNL_ARG_DST, memory_objects.at("gate_out")}
-    }});
+    // Scores = Q * K^T / sqrt(D) (+ mask). The mask starts out causal; a
+    // caller that pads sequences rewrites it through the "attn_mask" tensor.
+    graph.matmul(name("attn_scores"), "query", "key", "attn_scores");
+    graph.scale(name("attn_scale"), "attn_scores", "attn_scores", 1.0f / std::sqrt((float)D));
+    if (config.causal || config.padding_mask) {
+        if (!memory_objects.count("attn_mask")) {
+            auto mask_md = memory::desc({1, 1, S, S}, memory::data_type::f32, memory::format_tag::abcd);
+            memory mask(mask_md, eng);
+            float* m = static_cast<float*>(mask.get_data_handle());
+            for (memory::dim i = 0; i < S; i++) {
+                for (memory::dim j = 0; j < S; j++) {
+                    m[i * S + j] = config.causal && j > i ? -INFINITY : 0.0f;
+                }
+            }
+            memory_objects["attn_mask"] = mask;
+            model.bind_tensor("attn_mask", mask);
+        }
+        graph.binary(name("attn_mask_add"), "attn_scores", "attn_mask", "attn_scores", algorithm::binary_add);
+    }
 
-    printf("[DEBUG] Gating executed\n");
+    graph.softmax(name("attn_softmax"), "attn_scores", "attn_scores", /* axis = */ 3);
 
-    // Ensure `selected_experts` has the correct size
-    std::vector<std::vector<int>> selected_experts(12, std::vector<int>(k, 0));
+    // Context = P * V, written head-interleaved into attn_out [B, S, H]
+    graph.matmul(name("attn_context"), "attn_scores", "value", "attn_context");
 
-    // Insert custom function: Select top-K experts
-    model.insert_custom([&]() {
-        printf("[DEBUG] Selecting top-%d experts per token\n", k);
+    // Output projection with the residual add
+    graph.weight_matmul(name("attn_proj"), "attn_out", name("weight_o"), output);
+    graph.binary(name("attn_residual"), output, input, output, algorithm::binary_add);
+    if (!config.pre_norm) {
+        graph.layer_norm(name("ln1"), output, name("ln1_gamma"), name("ln1_beta"), output, config.layer_norm_eps);
+    }
+}
 
-        // Read gating scores from memory
-        std::vector<float> gating_scores(12 * num_experts, 0.0f);
-        read_from_dnnl_memory(gating_scores.data(), memory_objects.at("gate_out"));
+// Feedforward sub-block: output = input + act(norm(input) * W1 + b1) * W2 + b2,
+// with act ReLU, GELU (tanh or erf) or SwiGLU (act(h) = silu(h) *
+// (norm(input) * W3 + b3)). Biases, the activation and the residual add
+// are separate graph ops; fusion turns them into matmul bias/post-ops, so
+// the activation is applied as the first matmul writes.
+//
+// SwiGLU keeps W1 and W3 as one [2, hidden, ffn_hidden] weight: a single
+// GEMM broadcasts the [1, rows, hidden] input over both and writes the
+// gate and up projections as the two dense halves of ffn_gate_up. One
+// wide GEMM keeps more cores busy than two narrow ones at small row
+// counts. silu(gate) * up then overwrites the gate half as two elementwise
+// ops, since a post-op can't reach only half of a matmul's output.
+//
+// Tiled (see ffn_tile_rows), both matmuls run a block of rows at a time
+// over row views of the input and output; ffn_out (or ffn_gate_up) holds
+// a single tile. SwiGLU always runs on row views, untiled as one tile.
+void build_ffn_layer(std::map<std::string, memory>& memory_objects, OpGraph& graph,
+    const ModelConfig& config, int block, const std::string& input, const std::string& output) {
+    auto name = [block](const std::string& n) { return block_name(block, n); };
+
+    std::string ffn_in = input;
+    if (config.pre_norm) {
+        graph.layer_norm(name("ln2"), input, name("ln2_gamma"), name("ln2_beta"), "ln_out", config.layer_norm_eps);
+        ffn_in = "ln_out";
+    }
 
-        selected_experts = select_top_k_experts_per_token(gating_scores, 12, num_experts, k);
+    const bool swiglu = config.ffn_activation == FfnActivation::swiglu;
+    // Half `i` of (a tile view of) ffn_gate_up, as [1, rows, ffn_hidden]
+    auto half = [&](const std::string& wide, int i) {
+        auto dims = memory_objects.at(wide).get_desc().get_dims();
+        const memory::dim full_rows = memory_objects.at("ffn_gate_up").get_desc().get_dims()[1];
+        dims[0] = 1;
+        const std::string view = "half" + std::to_string(i) + "." + wide;
+        memory_objects[view] = create_view(memory_objects.at("ffn_gate_up"), create_memory_desc(dims),
+            i * full_rows * dims[2] * sizeof(float));
+        return view;
+    };
 
-        if (selected_experts.size() != 12 || selected_experts[0].size() != k) {
-            printf("[ERROR] Invalid selected_experts size: %zu x %zu\n", 
-                   selected_experts.size(), 
-                   selected_experts.empty() ? 0 : selected_experts[0].size());
-            throw std::runtime_error("Invalid selected_experts size");
+    // One FFN over [1, rows, hidden] views (or the whole tensors when
+    // untiled); `suffix` keeps the op names apart
+    auto add_ffn = [&](const std::string& src, const std::string& residual, const std::string& dst,
+        const std::string& hidden, const std::string& suffix) {
+        auto op = [&](const std::string& n) { return name(n) + suffix; };
+        std::string act = hidden;
+        if (swiglu) {
+            graph.weight_matmul(op("ffn13"), src, name("ffn_weight13"), hidden);
+            graph.bias_add(op("ffn13_bias"), hidden, name("ffn_bias13"), hidden);
+            act = half(hidden, 0);
+        } else {
+            graph.weight_matmul(op("ffn1"), src, name("ffn_weight1"), hidden);
+            graph.bias_add(op("ffn1_bias"), hidden, name("ffn_bias1"), hidden);
+        }
+        switch (config.ffn_activation) {
+            case FfnActivation::relu:
+                graph.eltwise(op("ffn1_relu"), act, act, algorithm::eltwise_relu, 0.0f, 0.0f);
+                break;
+            case FfnActivation::gelu_tanh:
+                graph.eltwise(op("ffn1_gelu"), act, act, algorithm::eltwise_gelu_tanh);
+                break;
+            case FfnActivation::gelu_erf:
+                graph.eltwise(op("ffn1_gelu"), act, act, algorithm::eltwise_gelu_erf);
+                break;
+            case FfnActivation::swiglu:
+                graph.eltwise(op("ffn1_silu"), act, act, algorithm::eltwise_swish, 1.0f);
+                graph.binary(op("ffn1_gate"), act, half(hidden, 1), act, algorithm::binary_mul);
+                break;
         }
 
-        printf("[DEBUG] Selected Experts per token:\n");
-        for (int token = 0; token < 12; token++) {
-            printf("Token %d: ", token);
-            for (int expert : selected_experts[token]) {
-                printf("%d ", expert);
-            }
-            printf("\n");
+        graph.weight_matmul(op("ffn2"), act, name("ffn_weight2"), dst);
+        graph.bias_add(op("ffn2_bias"), dst, name("ffn_bias2"), dst);
+        graph.binary(op("ffn_residual"), dst, residual, dst, algorithm::binary_add);
+    };
+
+    const int rows = config.batch * config.seq_len;
+    const int tile = ffn_tile_rows(config) ? ffn_tile_rows(config) : swiglu ? rows : 0;
+    const std::string hidden = swiglu ? "ffn_gate_up" : "ffn_out";
+    if (!tile) {
+        add_ffn(ffn_in, input, output, hidden, "");
+    } else {
+        const memory::dim H = config.hidden;
+        for (int row = 0; row < rows; row += tile) {
+            const int n = std::min(tile, rows - row);
+            const std::string prefix = "tile" + std::to_string(row / tile) + ".";
+            auto rows_md = create_memory_desc({1, n, H}, memory::format_tag::abc);
+            auto row_view = [&](const std::string& base) {
+                memory_objects[prefix + base] = create_view(memory_objects.at(base), rows_md, row * H * sizeof(float));
+                return prefix + base;
+            };
+            // A short last tile uses the start of the tile buffer; ffn_gate_up's
+            // halves keep their full-tile stride
+            auto tile_view = [&](const std::string& base) {
+                if (n == tile) return base;
+                auto md = memory_objects.at(base).get_desc();
+                auto dims = md.get_dims();
+                dims[1] = n;
+                memory_objects[prefix + base] = create_view(memory_objects.at(base),
+                    dims[0] == 1 ? create_memory_desc(dims) : memory::desc(dims, memory::data_type::f32, md.get_strides()), 0);
+                return prefix + base;
+            };
+            const std::string src = row_view(ffn_in);
+            const std::string residual = input == ffn_in ? src : row_view(input);
+            add_ffn(src, residual, row_view(output), tile_view(hidden),
+                tile < rows ? "[" + std::to_string(row / tile) + "]" : "");
         }
-    });
+    }
+    if (!config.pre_norm) {
+        graph.layer_norm(name("ln2"), output, name("ln2_gamma"), name("ln2_beta"), output, config.layer_norm_eps);
+    }
+}
 
-    printf("[DEBUG] Inserted custom function into pipeline\n");
+void build_moe_layer(engine& eng, std::map<std::string, memory>& memory_objects, OpGraph& graph,
+    PrimitivePipeline& model, PrimitiveCache& cache, const ModelConfig& config, const std::string& input) {
+    const int num_experts = config.num_experts;
+    const int k = config.top_k;
 
-    // Experts computation (MatMul + ReLU only for top-K per token)
-    model.insert_custom([&]() {
-        printf("[DEBUG] Executing expert computations\n");
+    LOG_DEBUG("Starting MoE Layer Construction\n");
 
-        for (int token_idx = 0; token_idx < 12; token_idx++) {
-            for (int i = 0; i < k; i++) {
-                int expert_idx = selected_experts[token_idx][i];
+    if (k > num_experts) {
+        LOG_ERROR("k (%d) cannot be greater than num_experts (%d)\n", k, num_experts);
+        throw std::invalid_argument("k cannot be greater than num_experts");
+    }
 
-                primitive_attr expert_attr;
-                post_ops expert_post_ops;
-                expert_post_ops.append_eltwise(algorithm::eltwise_relu, 1.0f, 0.0f);
-                expert_attr.set_post_ops(expert_post_ops);
+    // Gating mechanism (MatMul)
+    graph.weight_matmul("moe_gate", input, "gate_weight", "gate_out");
+
+    LOG_DEBUG("Gating executed\n");
+
+    // Dispatch state is owned by the custom ops, not by this function's stack
+    auto src_dims = memory_objects.at(input).get_desc().get_dims();
+    auto moe = std::make_shared<MoeDispatch>();
+    moe->hidden = (int)src_dims.back();
+    moe->num_tokens = (int)(product(src_dims) / moe->hidden);
+    moe->num_experts = num_experts;
+    moe->k = k;
+    moe->eng = eng;
+
+    // Experts quantize/convert their gathered rows themselves
+    moe->precision = config.precision;
+    moe->src_quant = input_quant_params(config, "moe_dispatch");
+
+    std::vector<memory> weights, biases, in_buffers, out_buffers;
+    for (int e = 0; e < num_experts; e++) {
+        std::string idx = std::to_string(e);
+        if (config.precision == Precision::int8) {
+            quantize_weight(eng, memory_objects, "expert_weight" + idx);
+            moe->expert_weight_scales.push_back(memory_objects.at("expert_weight" + idx + "_scales"));
+        }
+        weights.push_back(memory_objects.at("expert_weight" + idx));
+        biases.push_back(memory_objects.at("expert_bias" + idx));
+        in_buffers.push_back(memory_objects.at("expert_in" + idx));
+        out_buffers.push_back(memory_objects.at("expert_out" + idx));
+    }
+    moe->scratchpad = model.shared_scratchpad();
+    moe->threads = config.threads;
+    if (config.concurrent_branches) moe->branches = std::make_shared<BranchExecutor>(eng, config.threads);
+    if (config.expert_groups > 0) {
+        moe->expert_workers = affinity_workers(std::min(config.expert_groups, num_experts));
+    }
+    moe->capacity_factor = config.capacity_factor;
+    init_moe_dispatch(*moe, cache, weights, biases, in_buffers, out_buffers);
 
-                std::string expert_key = "expert_out" + std::to_string(expert_idx);
-                std::string expert_weight_key = "expert_weight" + std::to_string(expert_idx);
+    // The dispatch stage keeps the reordered expert weights; drop the plain ones
+    weights.clear();
+    for (int e = 0; e < num_experts; e++) {
+        memory_objects["expert_weight" + std::to_string(e)] = moe->expert_weights[e];
+    }
 
-                printf("[DEBUG] Processing Expert %d for Token %d\n", expert_idx, token_idx);
+    LOG_DEBUG("Created %d expert matmuls\n", num_experts);
+
+    // Insert custom function: Select top-K experts and their routing weights,
+    // read in place from gate_out
+    // Padded rows are routed but not bucketed, so they don't count against
+    // the capacity; every row starts out real
+    std::vector<std::string> route_inputs = {"gate_out"};
+    if (config.padding_mask) {
+        memory token_mask(memory::desc({moe->num_tokens}, memory::data_type::u8, memory::format_tag::a), eng);
+        std::memset(token_mask.get_data_handle(), 1, moe->num_tokens);
+        memory_objects["token_mask"] = token_mask;
+        model.bind_tensor("token_mask", token_mask);
+        route_inputs.push_back("token_mask");
+    }
+    graph.custom("moe_route", make_custom_op<MoeDispatch, route_moe_tokens>(moe), route_inputs, {});
+
+    // Experts computation (MatMul + ReLU only for the routed tokens). The
+    // expert buffers are declared through the views the dispatch uses.
+    std::vector<std::string> dispatch_outputs = {"moe_out"};
+    for (int e = 0; e < num_experts; e++) {
+        std::string idx = std::to_string(e);
+        memory_objects["moe_expert_in" + idx] = moe->expert_in[e];
+        memory_objects["moe_expert_out" + idx] = moe->expert_out[e];
+        dispatch_outputs.push_back("moe_expert_in" + idx);
+        dispatch_outputs.push_back("moe_expert_out" + idx);
+    }
+    graph.custom("moe_dispatch", make_custom_op<MoeDispatch, execute_moe_dispatch>(moe), {input}, dispatch_outputs);
 
-                auto expert_pd = matmul::primitive_desc(eng, 
-                    memory_objects.at("src").get_desc(),
-                    memory_objects.at(expert_weight_key).get_desc(),
-                    memory_objects.at(expert_key).get_desc(),
-                    expert_attr
-                );
+    LOG_DEBUG("MoE Layer Built with Top-%d Experts Per Token\n", k);
+}
 
-                model.insert({matmul(expert_pd), {
-                    {DNNL_ARG_SRC, memory_objects.at("src")},
-                    {DNNL_ARG_WEIGHTS, memory_objects.at(expert_weight_key)},
-                    {DNNL_ARG_BIAS, memory_objects.at("expert_bias" + std::to_string(expert_idx))},
-                    {DNNL_ARG_DST, memory_objects.at(expert_key)}
-                }});
+// Create and fill the model's weights once
+ModelWeights create_model_weights(engine& eng, const ModelConfig& config) {
+    auto weights = create_memory_objects(eng, define_weight_shapes(config));
+    for (const auto& [name, mem] : weights) {
+        init_memory(mem, init_spec(name, config.seed));
+    }
+    return weights;
+}
 
-                printf("[DEBUG] Inserted MatMul for Expert %d, Token %d\n", expert_idx, token_idx);
-            }
-        }
-    });
+// A stable string hash (see init_stream_id) of everything that shapes or
+// fills the weights
+uint64_t model_config_hash(const ModelConfig& config) {
+    std::string key = std::string(precision_name(config.precision)) + ";seed=" + std::to_string(config.seed);
+    for (const auto& [name, dims] : define_weight_shapes(config)) {
+        key += ";" + name;
+        for (auto d : dims) key += "," + std::to_string(d);
+    }
+    return init_stream_id(key);
+}
 
-    printf("[DEBUG] MoE Layer Built with Top-%d Experts Per Token\n", k);
+// Compare against the shapes create_model_weights would make. Saved
+// weights may be reordered or quantized, but keep their dims.
+std::string find_weight_mismatch(const ModelConfig& config, const ModelWeights& weights) {
+    for (const auto& [name, dims] : define_weight_shapes(config)) {
+        auto it = weights.find(name);
+        if (it == weights.end() || it->second.get_desc().get_dims() != dims) return name;
+    }
+    return "";
 }
 
 // Main function to build the model pipeline
-PrimitivePipeline build_model_pipeline(engine& eng) {
-    stream strm(eng);
-    
-    auto tensor_shapes = define_tensor_shapes();
-    auto tensor_data = allocate_and_initialize_tensors(tensor_shapes);
-    // printf("Memory initialized\n");
-    auto memory_objects = initialize_memory_objects(eng, tensor_shapes, tensor_data);
+PrimitivePipeline build_model_pipeline(engine& eng, const ModelConfig& config, ModelWeights& weights,
+    PrimitiveCache& cache) {
+    auto memory_objects = create_memory_objects(eng, define_activation_shapes(config));
+    // Intermediates are written before they are read; only the input needs data
+    init_memory(memory_objects.at("src"), init_spec("src", config.seed));
+    memory_objects.insert(weights.begin(), weights.end());
     // printf("Memory initialized\n");
     PrimitivePipeline model;
-    build_attention_layer(eng, memory_objects, model);
-    build_ffn_layer(eng, memory_objects, model);
-    build_moe_layer(eng, memory_objects, 4, 1, model);
-    // auto moe_layer = build_moe_layer(eng, memory_objects, 4);
-    
-    // model.insert(attention_layer);
-    // model.insert(ffn_layer);
-    // model.insert(model.end(), moe_layer.begin(), moe_layer.end());
+    if (config.shared_scratchpad) model.use_shared_scratchpad();
+
+    OpGraph graph(memory_objects);
+    graph.mark_output("src");
+    graph.mark_output("resid");
+    graph.mark_output("moe_out");
+
+    // The residual stream alternates between src and resid, so every
+    // residual add reads one tensor and writes the other
+    std::string x = "src";
+    auto next = [](const std::string& t) { return std::string(t == "src" ? "resid" : "src"); };
+    for (int b = 0; b < config.num_blocks; b++) {
+        if (config.layers & layer_attention) {
+            build_attention_layer(eng, memory_objects, graph, model, cache, config, b, x, next(x));
+            x = next(x);
+        }
+        if (config.layers & layer_ffn) {
+            build_ffn_layer(memory_objects, graph, config, b, x, next(x));
+            x = next(x);
+        }
+    }
+    if (config.pre_norm && x != "src") {
+        graph.layer_norm("final_ln", x, "final_ln_gamma", "final_ln_beta", "src", config.layer_norm_eps);
+        x = "src";
+    } else if (config.pre_norm && (config.layers & (layer_attention | layer_ffn))) {
+        graph.layer_norm("final_ln", x, "final_ln_gamma", "final_ln_beta", x, config.layer_norm_eps);
+    }
+    model.bind_tensor("block_out", memory_objects.at(x), tile_views(memory_objects, x));
+    if (config.layers & layer_moe) build_moe_layer(eng, memory_objects, graph, model, cache, config, x);
+
+    graph.fuse(eng);
+    graph.lower(eng, model, cache, base_attr(model, config),
+        [&](const GraphOp& op, const AttrSpec& attr, const std::unordered_map<int, memory>& args) {
+            insert_weight_matmul(eng, memory_objects, model, cache, config,
+                op.name, op.inputs[0], op.inputs[1], op.outputs[0], op.bias, attr, args);
+        });
+    // Stages must be known before planning so concurrent ops don't share bytes
+    if (config.concurrent_branches) model.enable_concurrency(eng, cache, config.threads);
+
+    // Keep the reordered (and quantized) weights, and the concatenations
+    // of merged ones ("a+b"), so later pipelines built from `weights` don't
+    // reorder (or hold a second copy of) them again. Mixing precisions
+    // therefore needs separate ModelWeights.
+    auto is_weight = [&](const std::string& name) {
+        size_t begin = 0;
+        for (size_t end; (end = name.find('+', begin)) != std::string::npos; begin = end + 1) {
+            if (!weights.count(name.substr(begin, end - begin))) return false;
+        }
+        return weights.count(name.substr(begin)) != 0;
+    };
+    for (const auto& [name, mem] : memory_objects) {
+        const bool is_scales = name.size() > 7 && name.compare(name.size() - 7, 7, "_scales") == 0;
+        if (is_weight(name) || (is_scales && is_weight(name.substr(0, name.size() - 7)))) {
+            weights[name] = mem;
+        }
+    }
+
+    // Intermediates share one arena; src (input), moe_out (output) and
+    // weights keep their own buffers. Views move with their base.
+    std::vector<memory> activations;
+    for (const auto& [name, mem] : memory_objects) {
+        if (is_activation(name) && !graph.get_views().count(name)) activations.push_back(mem);
+    }
+    model.plan_activations(activations);
+
+    model.bind_tensor("src", memory_objects.at("src"), tile_views(memory_objects, "src"));
+    model.bind_tensor("moe_out", memory_objects.at("moe_out"), tile_views(memory_objects, "moe_out"));
     return model;
 }
 
+PrimitivePipeline build_model_pipeline(engine& eng, const ModelConfig& config, PrimitiveCache& cache) {
+    auto weights = create_model_weights(eng, config);
+    return build_model_pipeline(eng, config, weights, cache);
+}
+
+void ModelReplica::execute(engine& eng) {
+#ifdef _OPENMP
+    if (pinned != std::this_thread::get_id()) {
+        pin_current_team(pool->get_cpus());
+        pinned = std::this_thread::get_id();
+    }
+#endif
+    pipeline.execute(eng, strm);
+    strm.wait();
+}
+
+std::vector<ModelReplica> build_model_replicas(engine& eng, const ModelConfig& config,
+    ModelWeights& weights, int replicas, PrimitiveCache& cache) {
+    ModelConfig replica_config = config;
+    replica_config.shared_scratchpad = true;
+
+    std::vector<ModelReplica> result;
+    std::map<std::string, void*> prepared;
+    for (const auto& group : partition_cores(replicas)) {
+        ModelReplica replica;
+        replica_config.threads = (int)group.cpus.size();
+        replica.pipeline = build_model_pipeline(eng, replica_config, weights, cache);
+        replica.pool = std::make_shared<ThreadPool>(group.cpus);
+        replica.strm = make_pool_stream(eng, *replica.pool);
+        replica.pipeline.set_thread_pool(replica.pool);
+
+        // Only the first build may replace weights; a later one doing so
+        // would give that replica a private copy
+        if (result.empty()) {
+            for (const auto& [name, mem] : weights) prepared[name] = mem.get_data_handle();
+        } else {
+            for (const auto& [name, mem] : weights) {
+                auto it = prepared.find(name);
+                if (it == prepared.end() || it->second != mem.get_data_handle()) {
+                    throw std::runtime_error("replica " + std::to_string(result.size())
+                        + " would hold its own copy of " + name);
+                }
+            }
+        }
+        LOG_INFO("Replica %zu: node %d, %zu CPUs\n", result.size(), group.node, group.cpus.size());
+        result.push_back(std::move(replica));
+    }
+    return result;
+}
+
+Calibration calibrate_model(engine& eng, const ModelConfig& config, const ModelWeights& weights,
+    const std::vector<std::vector<float>>& samples, PrimitiveCache& cache) {
+    ModelConfig f32_config = config;
+    f32_config.precision = Precision::f32;
+    ModelWeights f32_weights = weights;  // the build writes reordered copies back
+    PrimitivePipeline model = build_model_pipeline(eng, f32_config, f32_weights, cache);
+
+    // Ops whose input is quantized, without their block prefix or FFN tile
+    static const std::vector<std::string> quantized_ops = {
+        "qkv_proj", "attn_proj", "ffn1", "ffn13", "ffn2", "moe_gate", "moe_dispatch"
+    };
+    Calibration calibration;
+    stream strm(eng);
+    memory src = model.tensor("src");
+    for (const auto& sample : samples) {
+        write_to_dnnl_memory(const_cast<float*>(sample.data()), src);
+        model.execute_observed(eng, strm, [&](const MatMulOperation& op) {
+            std::string base = op.name.substr(op.name.find('.') + 1);
+            base = base.substr(0, base.find('['));
+            if (std::find(quantized_ops.begin(), quantized_ops.end(), base) == quantized_ops.end()) return;
+            auto it = op.args.find(DNNL_ARG_SRC);
+            if (it == op.args.end()) it = op.args.find(DNNL_ARG_MULTIPLE_SRC);
+            auto range = calibration.emplace(op.name, std::make_pair(INFINITY, -INFINITY)).first;
+            update_range(it->second, range->second);
+        });
+    }
+    LOG_INFO("Calibrated %zu ops on %zu samples\n", calibration.size(), samples.size());
+    return calibration;
+}
@@ -1,10 +1,165 @@
 #ifndef MODEL_BUILDER_HPP
 #define MODEL_BUILDER_HPP
 
+#include "PrimitiveCache.hpp"
 #include "PrimitivePipeline.hpp"
+#include "Quantization.hpp"
 #include "tensor_utils.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
-// Function to build the model pipeline
-PrimitivePipeline build_model_pipeline(dnnl::engine& eng);
+struct DecodeState;
+
+// Layers build_model_pipeline can include (bit mask)
+enum ModelLayer {
+    layer_attention = 1,
+    layer_ffn = 2,
+    layer_moe = 4,
+    layer_all = layer_attention | layer_ffn | layer_moe
+};
+
+// FFN activation. SwiGLU gates a second projection: silu(x * W1 + b1) *
+// (x * W3 + b3). W1 and W3 (b1 and b3) are stored together as one
+// [2, hidden, ffn_hidden] weight ("ffn_weight13", "ffn_bias13").
+enum class FfnActivation { relu, gelu_tanh, gelu_erf, swiglu };
+
+// Options for build_model_pipeline
+struct ModelConfig {
+    // Activation shape: src is [batch, seq_len, hidden]
+    int batch = 1;
+    int seq_len = 12;
+    int hidden = 768;
+
+    int num_heads = 12;
+    int ffn_hidden = 3072;
+    FfnActivation ffn_activation = FfnActivation::relu;
+    // Rows per FFN tile. When set (and smaller than batch * seq_len) each
+    // block of rows goes through both FFN matmuls before the next, so the
+    // [rows, ffn_hidden] intermediate stays in cache instead of a
+    // [batch * seq_len, ffn_hidden] one going through memory. 0 = untiled.
+    int ffn_tile_rows = 0;
+    int num_experts = 4;
+    int top_k = 1;
+    bool causal = true;
+
+    // Transformer blocks (attention + FFN, each with a residual add and a
+    // LayerNorm) stacked before the MoE layer. Pre-norm applies LayerNorm
+    // to each sub-block's input and once more after the last block;
+    // post-norm applies it after each residual add.
+    int num_blocks = 1;
+    bool pre_norm = true;
+    float layer_norm_eps = 1e-5f;
+
+    // Which layers to build, e.g. a single layer for benchmarking
+    int layers = layer_all;
+
+    // Build the attention mask even for non-causal models and expose it as
+    // the "attn_mask" tensor, so callers that pad sequences can mask the
+    // padded keys. The MoE layer also exposes "token_mask" (u8 per row of
+    // src, 1 = real token), so padded rows take no expert capacity.
+    bool padding_mask = false;
+
+    // All primitives use one user-managed scratchpad owned by the pipeline
+    // instead of each holding a library-managed one
+    bool shared_scratchpad = false;
+
+    // Run independent ops and the active MoE experts concurrently, each on
+    // a share of the OpenMP threads proportional to its FLOPs. Helps small
+    // shapes where one GEMM can't use every core.
+    bool concurrent_branches = false;
+
+    // OpenMP threads every primitive is created for, which oneDNN fixes at
+    // creation; 0 = omp_get_max_threads() of the building thread. Replicas
+    // set it to their core group's size.
+    int threads = 0;
+
+    // Expert parallelism: > 0 splits the experts over that many core groups
+    // (see partition_cores), each with a pinned worker that holds its
+    // experts' weights in node-local memory. Use at least as many groups as
+    // NUMA nodes; a group with several nodes spreads its weights over them.
+    int expert_groups = 0;
+    // Per-expert token limit as a multiple of the even share
+    // (num_tokens * top_k / num_experts); overflow is dropped. 0 = no limit.
+    float capacity_factor = 0.0f;
+
+    // Seed for the initial weights and input. The same seed gives the same
+    // tensors on every run and thread count.
+    uint64_t seed = 0;
+
+    // Precision of the weight matmuls (QKV, FFN, gate, experts). int8 needs
+    // an input range for each of them in `calibration` (see calibrate_model).
+    Precision precision = Precision::f32;
+    Calibration calibration;
+
+    // Incremental decoding: src holds only the new tokens of one sequence
+    // (batch 1) and attention reads earlier tokens from the KV cache the
+    // state points to. Usually set up by DecodeModel.
+    std::shared_ptr<DecodeState> decode;
+};
+
+// Weights by tensor name. Pipelines built from the same ModelWeights share
+// them; building replaces entries with copies in the primitives' preferred
+// layouts.
+using ModelWeights = std::map<std::string, dnnl::memory>;
+
+// Function to create and fill the model's weights
+ModelWeights create_model_weights(dnnl::engine& eng, const ModelConfig& config);
+
+// Function to hash what a config's weights depend on (their names and
+// dims, precision and seed), to tell whether saved weights fit it
+uint64_t model_config_hash(const ModelConfig& config);
+
+// Function to check that `weights` (e.g. loaded from a model file) holds
+// every weight `config` needs, with the dims it needs. Returns the first
+// missing or mismatched name, or "" when they match.
+std::string find_weight_mismatch(const ModelConfig& config, const ModelWeights& weights);
+
+// Function to build the model pipeline. Primitives come from `cache`, so
+// rebuilding a model (or building several) reuses already created ones.
+// The pipeline binds "src" (input), "block_out" (output of the last block)
+// and "moe_out" (output) as named tensors.
+PrimitivePipeline build_model_pipeline(dnnl::engine& eng, const ModelConfig& config,
+    ModelWeights& weights, PrimitiveCache& cache = PrimitiveCache::global());
+
+// Same, with freshly created weights
+PrimitivePipeline build_model_pipeline(dnnl::engine& eng,
+    const ModelConfig& config = ModelConfig(),
+    PrimitiveCache& cache = PrimitiveCache::global());
+
+// One replica of a served model: its own pipeline (activations and
+// scratchpad), stream and thread pool. The weights are referenced, not
+// owned.
+struct ModelReplica {
+    PrimitivePipeline pipeline;
+    std::shared_ptr<ThreadPool> pool;  // pinned to this replica's cores
+    dnnl::stream strm;
+    std::thread::id pinned;  // thread whose OpenMP team is on the pool's CPUs
+
+    // Run once on the calling thread. Under the OpenMP runtime the calling
+    // thread and its team are pinned to the pool's CPUs (once per thread);
+    // run each replica from its own thread.
+    void execute(dnnl::engine& eng);
+};
+
+// Build `replicas` pipelines of `config` over one set of weights. The first
+// build prepares `weights` (reorders, quantizes, merges); the others only
+// read them, so the weights are held once however many replicas there are.
+// The allowed CPUs are split into one core group per replica (see
+// partition_cores), and each replica's primitives are created for its
+// group's thread count. Replicas always use a shared scratchpad, so they
+// never share library-managed scratchpads while running concurrently.
+// Throws if a replica after the first would need a private weight copy
+// (e.g. a layout that depends on the thread count).
+std::vector<ModelReplica> build_model_replicas(dnnl::engine& eng, const ModelConfig& config,
+    ModelWeights& weights, int replicas, PrimitiveCache& cache = PrimitiveCache::global());
+
+// Run an f32 copy of the model on `samples` (each filling "src") and record
+// the input range of every weight matmul, for config.calibration in int8
+// mode. `weights` is not modified.
+Calibration calibrate_model(dnnl::engine& eng, const ModelConfig& config, const ModelWeights& weights,
+    const std::vector<std::vector<float>>& samples, PrimitiveCache& cache = PrimitiveCache::global());
 
 #endif // MODEL_BUILDER_HPP
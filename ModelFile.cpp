@@ -0,0 +1,138 @@
+#include "ModelFile.hpp"
+#include "Logging.hpp"
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace dnnl;
+
+namespace {
+
+const char magic[8] = {'D', 'N', 'N', 'L', 'M', 'D', 'L', '1'};
+const uint32_t version = 2;
+const uint64_t alignment = 64;
+
+uint64_t align_up(uint64_t offset) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+template <typename T>
+void put(std::vector<uint8_t>& out, T value) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+// Bounds-checked reader over the mapped table
+struct Reader {
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0;
+
+    const uint8_t* take(size_t n) {
+        if (n > size - pos) throw std::runtime_error("model file is truncated");
+        const uint8_t* p = data + pos;
+        pos += n;
+        return p;
+    }
+    template <typename T>
+    T get() {
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+};
+
+} // namespace
+
+void save_model_file(const std::string& path, const ModelWeights& weights, uint64_t config_hash) {
+    // Table size first: blob offsets depend on where the table ends
+    std::vector<std::vector<uint8_t>> blobs;
+    size_t table_bytes = sizeof(magic) + 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    for (const auto& [name, mem] : weights) {
+        blobs.push_back(mem.get_desc().get_blob());
+        table_bytes += 2 * sizeof(uint32_t) + name.size() + blobs.back().size() + 2 * sizeof(uint64_t);
+    }
+
+    std::vector<uint8_t> table(magic, magic + sizeof(magic));
+    put(table, version);
+    put(table, config_hash);
+    put(table, static_cast<uint32_t>(weights.size()));
+    uint64_t offset = align_up(table_bytes);
+    size_t i = 0;
+    for (const auto& [name, mem] : weights) {
+        put(table, static_cast<uint32_t>(name.size()));
+        table.insert(table.end(), name.begin(), name.end());
+        put(table, static_cast<uint32_t>(blobs[i].size()));
+        table.insert(table.end(), blobs[i].begin(), blobs[i].end());
+        uint64_t size = mem.get_desc().get_size();
+        put(table, offset);
+        put(table, size);
+        offset = align_up(offset + size);
+        i++;
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) throw std::runtime_error("cannot open model file for writing: " + path);
+    out.write(reinterpret_cast<const char*>(table.data()), table.size());
+    uint64_t pos = table.size();
+    static const char zeros[alignment] = {};
+    for (const auto& [name, mem] : weights) {
+        uint64_t start = align_up(pos);
+        out.write(zeros, start - pos);
+        uint64_t size = mem.get_desc().get_size();
+        out.write(static_cast<const char*>(mem.get_data_handle()), size);
+        pos = start + size;
+    }
+    if (!out) throw std::runtime_error("failed to write model file: " + path);
+    LOG_INFO("Saved %zu tensors (%llu bytes) to %s\n", weights.size(), (unsigned long long)pos, path.c_str());
+}
+
+MappedWeights load_model_file(const engine& eng, const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open model file: " + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("cannot stat model file: " + path);
+    }
+    const size_t file_size = st.st_size;
+    void* base = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // the mapping stays valid
+    if (base == MAP_FAILED) throw std::runtime_error("cannot mmap model file: " + path);
+
+    MappedWeights mapped;
+    mapped.file_size = file_size;
+    mapped.mapping = std::shared_ptr<void>(base, [file_size](void* p) { munmap(p, file_size); });
+
+    Reader in{static_cast<const uint8_t*>(base), file_size};
+    if (std::memcmp(in.take(sizeof(magic)), magic, sizeof(magic)) != 0) {
+        throw std::runtime_error("not a model file: " + path);
+    }
+    if (in.get<uint32_t>() != version) throw std::runtime_error("unsupported model file version: " + path);
+    mapped.config_hash = in.get<uint64_t>();
+
+    const uint32_t count = in.get<uint32_t>();
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t name_len = in.get<uint32_t>();
+        std::string name(reinterpret_cast<const char*>(in.take(name_len)), name_len);
+        uint32_t blob_len = in.get<uint32_t>();
+        const uint8_t* blob = in.take(blob_len);
+        memory::desc md(std::vector<uint8_t>(blob, blob + blob_len));
+        uint64_t offset = in.get<uint64_t>();
+        uint64_t size = in.get<uint64_t>();
+        if (offset % alignment != 0 || offset > file_size || size > file_size - offset || size != md.get_size()) {
+            throw std::runtime_error("corrupt model file entry " + name + ": " + path);
+        }
+        // Primitives only read weights, so the read-only mapping is safe
+        void* handle = static_cast<uint8_t*>(base) + offset;
+        mapped.weights[name] = memory(md, eng, handle);
+    }
+    LOG_INFO("Mapped %u tensors (%zu bytes) from %s\n", count, file_size, path.c_str());
+    return mapped;
+}
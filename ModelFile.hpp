@@ -0,0 +1,40 @@
+#ifndef MODEL_FILE_HPP
+#define MODEL_FILE_HPP
+
+#include "ModelBuilder.hpp"
+#include "oneapi/dnnl/dnnl.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// On-disk model format:
+//
+//   header   magic "DNNLMDL1", u32 version, u64 config hash, u32 tensor count
+//   table    per tensor: u32 name length, name, u32 desc length,
+//            memory desc blob (dims, data type, layout), u64 offset, u64 size
+//   data     one blob per tensor, each at a 64-byte aligned file offset
+//
+// The desc blob records the exact layout, so weights saved after a build
+// (already reordered into the primitives' blocked layouts, or quantized)
+// load without any reorder on the same machine. The config hash
+// (model_config_hash) tells whether the file fits a given ModelConfig.
+
+// Weights backed by a read-only mapping of a model file. The memory
+// objects point into the mapping, so it must outlive every pipeline built
+// from them; `mapping` keeps it alive for as long as a copy is held.
+struct MappedWeights {
+    ModelWeights weights;
+    std::shared_ptr<void> mapping;
+    size_t file_size = 0;
+    uint64_t config_hash = 0;
+};
+
+// Write every tensor of `weights` in its current layout, tagged with the
+// model_config_hash of the config they were created for
+void save_model_file(const std::string& path, const ModelWeights& weights, uint64_t config_hash);
+
+// mmap `path` and wrap each tensor as a dnnl::memory user handle. No data
+// is copied or touched until a primitive reads it.
+MappedWeights load_model_file(const dnnl::engine& eng, const std::string& path);
+
+#endif // MODEL_FILE_HPP
@@ -0,0 +1,398 @@
+#include "MoeDispatch.hpp"
+#include "Logging.hpp"
+#include "ThreadPool.hpp"
+#include "tensor_utils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+
+using namespace dnnl;
+
+// View a plain-layout tensor as 2D of type `dt` without copying. The view
+// does not own the buffer: keep `mem` alive alongside it.
+static memory as_2d(const memory& mem, memory::dim rows, memory::dim cols,
+    memory::data_type dt = memory::data_type::f32) {
+    auto md = memory::desc({rows, cols}, dt, memory::format_tag::ab);
+    return memory(md, mem.get_engine(), mem.get_data_handle());
+}
+
+// Copy one f32 row into a gathered batch, converting to the batch's type
+static void gather_row(const MoeDispatch& d, const float* src, void* batch, int row) {
+    const size_t H = d.hidden;
+    switch (d.precision) {
+        case Precision::f32:
+            std::memcpy(static_cast<float*>(batch) + row * H, src, sizeof(float) * H);
+            break;
+        case Precision::bf16: {
+            uint16_t* dst = static_cast<uint16_t*>(batch) + row * H;
+            for (size_t h = 0; h < H; h++) dst[h] = float_to_bf16(src[h]);
+            break;
+        }
+        case Precision::int8: {
+            uint8_t* dst = static_cast<uint8_t*>(batch) + row * H;
+            for (size_t h = 0; h < H; h++) dst[h] = quantize_u8(src[h], d.src_quant);
+            break;
+        }
+    }
+}
+
+// Up to this k, top-k scans the row once per expert picked
+static const int max_scan_k = 8;
+
+// Placements of the live dispatches. A placement owns its weights, so a
+// matching data handle is that very buffer, never a reused address.
+static std::mutex placed_mutex;
+static std::vector<std::weak_ptr<const std::vector<PlacedWeight>>> placements;
+
+static bool is_placed(const memory& mem, const AffinityWorker* worker) {
+    std::lock_guard<std::mutex> lock(placed_mutex);
+    bool found = false;
+    for (auto it = placements.begin(); it != placements.end();) {
+        auto placement = it->lock();
+        if (!placement) {
+            it = placements.erase(it);  // its dispatch is gone
+            continue;
+        }
+        for (const auto& placed : *placement) {
+            found = found || (placed.worker == worker && placed.weight.get_data_handle() == mem.get_data_handle());
+        }
+        ++it;
+    }
+    return found;
+}
+
+static void register_placement(const std::shared_ptr<std::vector<PlacedWeight>>& placement) {
+    std::lock_guard<std::mutex> lock(placed_mutex);
+    placements.push_back(placement);
+}
+
+void init_moe_dispatch(MoeDispatch& d, PrimitiveCache& cache,
+    const std::vector<memory>& weights,
+    const std::vector<memory>& biases,
+    const std::vector<memory>& in_buffers,
+    const std::vector<memory>& out_buffers) {
+
+    if ((int)weights.size() != d.num_experts || (int)biases.size() != d.num_experts
+        || (int)in_buffers.size() != d.num_experts || (int)out_buffers.size() != d.num_experts) {
+        throw std::invalid_argument("MoE dispatch needs one weight, bias and buffer set per expert");
+    }
+
+    const bool int8 = d.precision == Precision::int8;
+    if (int8 && (int)d.expert_weight_scales.size() != d.num_experts) {
+        throw std::invalid_argument("int8 MoE dispatch needs weight scales per expert");
+    }
+
+    const memory::dim H = d.hidden;
+    const auto src_dt = input_data_type(d.precision);
+    auto rt_src_md = memory::desc({DNNL_RUNTIME_DIM_VAL, H}, src_dt, memory::format_tag::ab);
+    auto rt_dst_md = memory::desc({DNNL_RUNTIME_DIM_VAL, H}, memory::data_type::f32, memory::format_tag::ab);
+
+    AttrSpec expert_attr;
+    expert_attr.threads = d.threads;
+    if (d.scratchpad) expert_attr.scratchpad = scratchpad_mode::user;
+    expert_attr.append_eltwise(algorithm::eltwise_relu, 0.0f, 0.0f);
+    if (int8) {
+        expert_attr.scales = {{DNNL_ARG_SRC, 0}, {DNNL_ARG_WEIGHTS, 1 << 1}};
+        expert_attr.zero_points = {{DNNL_ARG_SRC, 0}};
+        d.src_scale = make_scale(d.src_quant.scale, d.eng);
+        d.src_zero_point = make_zero_point(d.src_quant.zero_point, d.eng);
+    }
+
+    const int groups = (int)d.expert_workers.size();
+    for (int g = 0; g < groups; g++) d.worker_streams.emplace_back(d.eng);
+    d.worker_done.resize(groups);
+    if (groups > 0) d.placement = std::make_shared<std::vector<PlacedWeight>>();
+    if (groups == 0 && d.branches) {
+        d.branch_workers = std::min(d.num_experts, d.branches->max_workers());
+        expert_attr.threads = d.branches->max_workers() / d.branch_workers;  // even share
+    }
+
+    for (int e = 0; e < d.num_experts; e++) {
+        d.expert_biases.push_back(biases[e]);
+        d.expert_buffers.push_back(in_buffers[e]);
+        d.expert_buffers.push_back(out_buffers[e]);
+        d.expert_in.push_back(as_2d(in_buffers[e], d.num_tokens, H, src_dt));
+        d.expert_out.push_back(as_2d(out_buffers[e], d.num_tokens, H));
+
+        // Experts share a shape, so only the first one (per worker team
+        // size) creates a primitive
+        const int g = groups > 0 ? e * groups / d.num_experts : 0;
+        AttrSpec attr = expert_attr;
+        if (groups > 0) attr.threads = (int)d.expert_workers[g]->get_group().cpus.size();
+        auto expert = cache.get_matmul(d.eng, rt_src_md,
+            memory::desc({H, H}, weight_data_type(d.precision), memory::format_tag::any),
+            d.expert_biases[e].get_desc(),
+            rt_dst_md,
+            attr);
+        d.expert_matmuls.push_back(expert.prim);
+        d.expert_scratchpad_mds.push_back(expert.pd.scratchpad_desc());
+        if (d.scratchpad) d.scratchpad->reserve(d.expert_scratchpad_mds.back());
+        if (groups == 0) {
+            d.expert_weights.push_back(reorder_memory(weights[e], expert.pd.weights_desc(0), d.eng));
+            continue;
+        }
+
+        // Copy from the owning worker so the pages are first touched on its
+        // node, unless an earlier pipeline already placed them there. The
+        // bias is small and stays shared.
+        d.expert_group.push_back(g);
+        const AffinityWorker* worker = d.expert_workers[g].get();
+        if (weights[e].get_desc() == expert.pd.weights_desc(0) && is_placed(weights[e], worker)) {
+            d.expert_weights.push_back(weights[e]);
+            d.placement->push_back({weights[e], worker});
+            continue;
+        }
+        auto to_weights = cache.get_reorder(d.eng, weights[e].get_desc(), expert.pd.weights_desc(0));
+        memory local;
+        d.expert_workers[g]->run([&]() {
+            local = memory(expert.pd.weights_desc(0), d.eng);
+            to_weights.prim.execute(d.worker_streams[g], {{DNNL_ARG_FROM, weights[e]}, {DNNL_ARG_TO, local}});
+            d.worker_streams[g].wait();
+        });
+        d.expert_weights.push_back(local);
+        d.placement->push_back({local, worker});
+    }
+    if (d.placement) register_placement(d.placement);
+
+    for (int e = 0; e < d.num_experts; e++) {
+        std::unordered_map<int, memory> args = {
+            {DNNL_ARG_SRC, d.expert_in[e]},
+            {DNNL_ARG_WEIGHTS, d.expert_weights[e]},
+            {DNNL_ARG_BIAS, d.expert_biases[e]},
+            {DNNL_ARG_DST, d.expert_out[e]}
+        };
+        if (int8) {
+            args[DNNL_ARG_ATTR_SCALES | DNNL_ARG_SRC] = d.src_scale;
+            args[DNNL_ARG_ATTR_ZERO_POINTS | DNNL_ARG_SRC] = d.src_zero_point;
+            args[DNNL_ARG_ATTR_SCALES | DNNL_ARG_WEIGHTS] = d.expert_weight_scales[e];
+        }
+        if (d.scratchpad && d.expert_scratchpad_mds[e].get_size() > 0) {
+            args[DNNL_ARG_SCRATCHPAD] = memory(d.expert_scratchpad_mds[e], d.eng, nullptr);
+        }
+        d.expert_args.push_back(std::move(args));
+    }
+    d.expert_in_rows.assign(d.num_experts, std::vector<memory>(d.num_tokens));
+    d.expert_out_rows.assign(d.num_experts, std::vector<memory>(d.num_tokens));
+    // Concurrent experts each use their worker's scratchpad slot
+    if (d.scratchpad && groups > 0) {
+        d.scratchpad->reserve_slots(groups);
+    } else if (d.scratchpad && d.branches) {
+        d.scratchpad->reserve_slots(d.branch_workers);
+    }
+
+    d.top_experts.assign((size_t)d.num_tokens * d.k, 0);
+    d.top_weights.assign((size_t)d.num_tokens * d.k, 0.0f);
+    d.expert_count.assign(d.num_experts, 0);
+    d.expert_tokens.assign((size_t)d.num_experts * d.num_tokens, 0);
+    d.expert_token_weights.assign((size_t)d.num_experts * d.num_tokens, 0.0f);
+    if (d.k > max_scan_k) d.route_order.assign((size_t)d.num_tokens * d.num_experts, 0);
+}
+
+// Gather the rows routed to expert `e` and run its matmul on `strm`, with
+// scratchpad slot `slot`
+static void run_expert(MoeDispatch& d, const float* src, int e, stream& strm, int slot) {
+    const int T = d.num_tokens;
+    const int H = d.hidden;
+    const int count = d.expert_count[e];
+
+    void* in = d.expert_in[e].get_data_handle();
+    for (int row = 0; row < count; row++) {
+        gather_row(d, src + (size_t)d.expert_tokens[e * T + row] * H, in, row);
+    }
+
+    // Only this run's worker touches expert e, so the views and args need no lock
+    memory& batch_in = d.expert_in_rows[e][count - 1];
+    memory& batch_out = d.expert_out_rows[e][count - 1];
+    if (!batch_in) {
+        batch_in = memory(memory::desc({count, H}, input_data_type(d.precision), memory::format_tag::ab), d.eng, in);
+        batch_out = memory(memory::desc({count, H}, memory::data_type::f32, memory::format_tag::ab), d.eng,
+            d.expert_out[e].get_data_handle());
+    }
+
+    auto& args = d.expert_args[e];
+    args.at(DNNL_ARG_SRC) = batch_in;
+    args.at(DNNL_ARG_DST) = batch_out;
+    auto scratchpad = args.find(DNNL_ARG_SCRATCHPAD);
+    if (scratchpad != args.end()) scratchpad->second.set_data_handle(d.scratchpad->slot(slot));
+    d.expert_matmuls[e].execute(strm, args);
+}
+
+// Routing score of a logit: NaN ranks as -inf, so every row is totally
+// ordered and a NaN logit can't make the top-k come up short
+static inline float route_score(float logit) {
+    return logit == logit ? logit : -INFINITY;
+}
+
+// Position of the best score ranked after (prev_score, prev_index), i.e.
+// lower, or equal at a higher index. The max is branch-free so it
+// vectorizes; `best` gets its score. Scores are compared as route_score,
+// so the i-th call (i < n) always finds one.
+static int next_best(const float* scores, int n, float prev_score, int prev_index, float& best) {
+    float max_score = -INFINITY;
+    #pragma omp simd reduction(max:max_score)
+    for (int j = 0; j < n; j++) {
+        const float s = route_score(scores[j]);
+        bool after = s < prev_score || (s == prev_score && j > prev_index);
+        max_score = std::max(max_score, after ? s : -INFINITY);
+    }
+    int found = n - 1;
+    for (int j = 0; j < n; j++) {
+        const float s = route_score(scores[j]);
+        bool after = s < prev_score || (s == prev_score && j > prev_index);
+        if (after && s == max_score) {
+            found = j;
+            break;
+        }
+    }
+    best = max_score;
+    return found;
+}
+
+void route_moe_tokens(MoeDispatch& d, stream& strm, const CustomOp::Args& args) {
+    (void)strm;
+    const int T = d.num_tokens;
+    const int E = d.num_experts;
+    const int k = d.k;
+    const float* logits = static_cast<const float*>(args.at(DNNL_ARG_MULTIPLE_SRC).get_data_handle());
+
+    // Top-k per token, best first. Small k takes k vectorized passes over
+    // the row; large k partially sorts an index list. Chunks of ~4K logits
+    // run on the pipeline's thread pool (OpenMP without one).
+    parallel_range(T, std::max(1, 4096 / E), [&](int64_t begin, int64_t end) {
+        for (int t = (int)begin; t < (int)end; t++) {
+            const float* row = logits + (size_t)t * E;
+            int* experts = d.top_experts.data() + (size_t)t * k;
+            float* weights = d.top_weights.data() + (size_t)t * k;
+
+            if (k <= max_scan_k) {
+                float score = INFINITY;
+                int index = -1;
+                for (int i = 0; i < k; i++) {
+                    index = next_best(row, E, score, index, score);
+                    experts[i] = index;
+                    weights[i] = score;
+                }
+            } else {
+                int* order = d.route_order.data() + (size_t)t * E;
+                for (int j = 0; j < E; j++) order[j] = j;
+                std::partial_sort(order, order + k, order + E, [row](int a, int b) {
+                    const float sa = route_score(row[a]), sb = route_score(row[b]);
+                    return sa > sb || (sa == sb && a < b);
+                });
+                for (int i = 0; i < k; i++) {
+                    experts[i] = order[i];
+                    weights[i] = route_score(row[order[i]]);
+                }
+            }
+
+            // Routing weights: softmax over the selected logits. With an
+            // infinite best logit (or only -inf ones) the ties share it.
+            const float max_score = weights[0];
+            if (!std::isfinite(max_score)) {
+                int ties = 0;
+                for (int i = 0; i < k; i++) ties += weights[i] == max_score;
+                for (int i = 0; i < k; i++) weights[i] = weights[i] == max_score ? 1.0f / ties : 0.0f;
+                continue;
+            }
+            float sum = 0.0f;
+            for (int i = 0; i < k; i++) {
+                weights[i] = std::exp(weights[i] - max_score);
+                sum += weights[i];
+            }
+            for (int i = 0; i < k; i++) weights[i] /= sum;
+        }
+    });
+
+    // Bucket (token, weight) pairs by expert, choice rank by choice rank,
+    // dropping what doesn't fit under the capacity. The capacity is a share
+    // of the real tokens; padded rows are skipped.
+    auto mask_arg = args.find(DNNL_ARG_MULTIPLE_SRC + 1);
+    const uint8_t* valid = mask_arg == args.end() ? nullptr
+        : static_cast<const uint8_t*>(mask_arg->second.get_data_handle());
+    const int real_tokens = valid ? (int)std::count_if(valid, valid + T, [](uint8_t v) { return v != 0; }) : T;
+    int capacity = T;
+    if (d.capacity_factor > 0.0f) {
+        capacity = std::min(T, (int)std::ceil(d.capacity_factor * real_tokens * d.k / d.num_experts));
+    }
+    std::fill(d.expert_count.begin(), d.expert_count.end(), 0);
+    size_t dropped = 0;
+    for (int i = 0; i < d.k; i++) {
+        for (int t = 0; t < T; t++) {
+            if (valid && !valid[t]) continue;
+            int e = d.top_experts[t * d.k + i];
+            if (d.expert_count[e] >= capacity) {
+                dropped++;
+                continue;
+            }
+            int row = d.expert_count[e]++;
+            d.expert_tokens[e * T + row] = t;
+            d.expert_token_weights[e * T + row] = d.top_weights[t * d.k + i];
+        }
+    }
+    if (dropped > 0) LOG_DEBUG("MoE dropped %zu of %d assignments over capacity %d\n", dropped, real_tokens * d.k, capacity);
+    d.dropped += dropped;
+}
+
+void execute_moe_dispatch(MoeDispatch& d, stream& strm, const CustomOp::Args& args) {
+    const int T = d.num_tokens;
+    const int H = d.hidden;
+    const float* src = static_cast<const float*>(args.at(DNNL_ARG_MULTIPLE_SRC).get_data_handle());
+    float* out = static_cast<float*>(args.at(DNNL_ARG_MULTIPLE_DST).get_data_handle());
+
+    // Gather the routed rows into one contiguous batch per expert and run it
+    if (!d.expert_workers.empty()) {
+        // Each worker runs its own experts next to their weights
+        const int groups = (int)d.expert_workers.size();
+        for (int g = 0; g < groups; g++) {
+            d.worker_done[g] = d.expert_workers[g]->submit([&d, src, g]() {
+                for (int e = 0; e < d.num_experts; e++) {
+                    if (d.expert_group[e] == g && d.expert_count[e] > 0) run_expert(d, src, e, d.worker_streams[g], g);
+                }
+                d.worker_streams[g].wait();
+            });
+        }
+        std::exception_ptr failure;
+        for (auto& done : d.worker_done) {
+            try {
+                done.get();
+            } catch (...) {
+                if (!failure) failure = std::current_exception();
+            }
+        }
+        if (failure) std::rethrow_exception(failure);
+    } else if (d.branches) {
+        std::vector<int> active;
+        std::vector<double> costs;
+        for (int e = 0; e < d.num_experts; e++) {
+            if (d.expert_count[e] == 0) continue;
+            active.push_back(e);
+            costs.push_back(2.0 * d.expert_count[e] * H * H);
+        }
+        d.branches->plan_even(costs, d.branch_workers, d.branch_plan);
+        d.branches->run(d.branch_plan, [&](int b, int worker) {
+            run_expert(d, src, active[b], d.branches->worker_stream(worker), worker);
+        });
+    } else {
+        for (int e = 0; e < d.num_experts; e++) {
+            if (d.expert_count[e] > 0) run_expert(d, src, e, strm, 0);
+        }
+        strm.wait();
+    }
+
+    // Scatter back, weighted by the gate scores
+    std::memset(out, 0, sizeof(float) * (size_t)T * H);
+    for (int e = 0; e < d.num_experts; e++) {
+        const float* res = static_cast<const float*>(d.expert_out[e].get_data_handle());
+        for (int row = 0; row < d.expert_count[e]; row++) {
+            float w = d.expert_token_weights[e * T + row];
+            float* token_out = out + (size_t)d.expert_tokens[e * T + row] * H;
+            const float* r = res + (size_t)row * H;
+            for (int h = 0; h < H; h++) {
+                token_out[h] += w * r[h];
+            }
+        }
+    }
+}
@@ -0,0 +1,130 @@
+#ifndef MOE_DISPATCH_HPP
+#define MOE_DISPATCH_HPP
+
+#include "oneapi/dnnl/dnnl.hpp"
+#include "Affinity.hpp"
+#include "BranchExecutor.hpp"
+#include "PrimitiveCache.hpp"
+#include "PrimitivePipeline.hpp"
+#include "Quantization.hpp"
+#include <future>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// An expert weight copied by (and so first touched next to) a worker
+struct PlacedWeight {
+    dnnl::memory weight;
+    const AffinityWorker* worker;
+};
+
+// State of the MoE dispatch stage. build_moe_layer creates it once and the
+// pipeline's custom ops hold it through a shared_ptr, so nothing here points
+// at locals of the builder.
+struct MoeDispatch {
+    int num_tokens = 0;
+    int hidden = 0;
+    int num_experts = 0;
+    int k = 0;
+
+    dnnl::engine eng;
+    int threads = 0;  // OpenMP threads the expert matmuls are created for (0 = all)
+
+    // One matmul per expert, created at build time with a runtime M so the
+    // same primitive serves any number of routed tokens.
+    std::vector<dnnl::primitive> expert_matmuls;
+    std::vector<dnnl::memory> expert_weights;  // [hidden, hidden], primitive's layout
+    std::vector<dnnl::memory> expert_biases;   // [1, hidden]
+    std::vector<dnnl::memory> expert_in;       // gathered rows, [num_tokens, hidden], input precision
+    std::vector<dnnl::memory> expert_out;      // expert results, [num_tokens, hidden]
+    // The buffers expert_in / expert_out view; held so the views outlive
+    // the builder's memory objects
+    std::vector<dnnl::memory> expert_buffers;
+
+    // Set before init. In bf16/int8 mode the gather converts/quantizes the
+    // rows, so expert_in holds bf16/u8; int8 also needs per-expert weight
+    // scales for the s8 weights.
+    Precision precision = Precision::f32;
+    QuantParams src_quant;
+    std::vector<dnnl::memory> expert_weight_scales;
+    dnnl::memory src_scale, src_zero_point;
+
+    // Set before init to run the experts on the pipeline's shared scratchpad
+    std::shared_ptr<SharedScratchpad> scratchpad;
+    std::vector<dnnl::memory::desc> expert_scratchpad_mds;
+
+    // Each expert matmul's arguments, built by init; a run only swaps in
+    // the [rows, hidden] views for its row count and points the scratchpad
+    // at its slot. The views ([expert][rows - 1]) are made on first use.
+    std::vector<std::unordered_map<int, dnnl::memory>> expert_args;
+    std::vector<std::vector<dnnl::memory>> expert_in_rows, expert_out_rows;
+
+    // Set before init to run the active experts concurrently: they are
+    // packed by routed tokens onto branch_workers workers that split the
+    // threads evenly, and the expert matmuls are created for that share
+    std::shared_ptr<BranchExecutor> branches;
+    int branch_workers = 0;  // filled by init
+    BranchPlan branch_plan;  // refilled on every run
+
+    // Set before init for expert parallelism: experts are split into
+    // contiguous groups, one per worker, and each group's weights are copied
+    // from its worker so they are first touched on (and stay in) that
+    // worker's NUMA node; each expert matmul is created for its worker's
+    // team. Takes precedence over `branches`.
+    std::vector<std::shared_ptr<AffinityWorker>> expert_workers;
+    std::vector<int> expert_group;           // expert -> worker, filled by init
+    std::vector<dnnl::stream> worker_streams;
+    std::vector<std::future<void>> worker_done;
+    // The placed weights, filled by init. Registered (weakly) so a later
+    // dispatch over the same weights reuses them while this one lives.
+    std::shared_ptr<std::vector<PlacedWeight>> placement;
+
+    // Each expert takes at most ceil(capacity_factor * num_tokens * k /
+    // num_experts) tokens; the rest of its assignments are dropped (they
+    // add nothing to moe_out). 0 means no limit.
+    float capacity_factor = 0.0f;
+    size_t dropped = 0;  // (token, expert) assignments dropped so far
+
+    // Routing, refreshed on every run by route_moe_tokens. top_experts /
+    // top_weights are [num_tokens * k], best first; expert_count is the
+    // number of rows routed to each expert and the expert_* arrays are
+    // [num_experts * num_tokens], listing per expert which token each
+    // gathered row came from. All are allocated by init.
+    std::vector<int> top_experts;
+    std::vector<float> top_weights;
+    std::vector<int> expert_count;
+    std::vector<int> expert_tokens;
+    std::vector<float> expert_token_weights;
+    std::vector<int> route_order;  // [num_tokens * num_experts], only for large k
+};
+
+// Create the expert primitives (through `cache`) and routing buffers.
+// Weights ([hidden, hidden]) and biases ([1, hidden]) are the per-expert
+// tensors from the model's memory objects, in any layout (already s8 in
+// int8 mode). The f32 buffers must be large enough for [num_tokens, hidden].
+void init_moe_dispatch(MoeDispatch& d, PrimitiveCache& cache,
+    const std::vector<dnnl::memory>& weights,
+    const std::vector<dnnl::memory>& biases,
+    const std::vector<dnnl::memory>& in_buffers,
+    const std::vector<dnnl::memory>& out_buffers);
+
+// Custom-op kernels. route_moe_tokens reads gate_out [num_tokens,
+// num_experts] (DNNL_ARG_MULTIPLE_SRC); execute_moe_dispatch reads src
+// [num_tokens, hidden] (DNNL_ARG_MULTIPLE_SRC) and writes moe_out
+// [num_tokens, hidden] (DNNL_ARG_MULTIPLE_DST). Both run expert work on
+// `strm` unless workers/branches bring their own streams.
+//
+// Route every token to its top-k experts, reading the gate logits straight
+// from gate_out. The routing weights are a softmax over the k selected
+// logits. Then bucket the tokens by expert: with a capacity limit, first
+// choices are placed before second choices and so on, so a token loses its
+// lower-ranked experts first. An optional second input (u8 [num_tokens],
+// 0 = padding) leaves padded rows out of the buckets and the capacity.
+void route_moe_tokens(MoeDispatch& d, dnnl::stream& strm, const CustomOp::Args& args);
+
+// Gather the tokens routed to each expert, run one matmul per active expert
+// and scatter the results into moe_out weighted by the gate scores.
+// Expects the buckets from route_moe_tokens.
+void execute_moe_dispatch(MoeDispatch& d, dnnl::stream& strm, const CustomOp::Args& args);
+
+#endif // MOE_DISPATCH_HPP
@@ -0,0 +1,455 @@
+#include "OpGraph.hpp"
+#include "Logging.hpp"
+#include "tensor_utils.h"
+#include "example_utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+using namespace dnnl;
+
+namespace {
+
+bool is_elementwise(GraphOp::Kind kind) {
+    return kind == GraphOp::Kind::bias_add || kind == GraphOp::Kind::eltwise
+        || kind == GraphOp::Kind::binary || kind == GraphOp::Kind::scale;
+}
+
+const char* kind_name(GraphOp::Kind kind) {
+    switch (kind) {
+        case GraphOp::Kind::matmul: return "matmul";
+        case GraphOp::Kind::bias_add: return "bias_add";
+        case GraphOp::Kind::eltwise: return "eltwise";
+        case GraphOp::Kind::binary: return "binary";
+        case GraphOp::Kind::scale: return "scale";
+        case GraphOp::Kind::softmax: return "softmax";
+        case GraphOp::Kind::layer_norm: return "layer_norm";
+        case GraphOp::Kind::custom: return "custom";
+    }
+    return "unknown";
+}
+
+// Dense row-major desc
+memory::desc plain_md(const memory::dims& dims, memory::data_type dt) {
+    memory::dims strides(dims.size(), 1);
+    for (int i = (int)dims.size() - 2; i >= 0; i--) strides[i] = strides[i + 1] * dims[i + 1];
+    return memory::desc(dims, dt, strides);
+}
+
+bool same_except_last(const memory::dims& a, const memory::dims& b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end() - 1, b.begin());
+}
+
+// Concatenate f32 tensors along their last dim into a new plain tensor
+memory concat_last_dim(engine& eng, const std::vector<memory>& parts) {
+    auto dims = parts[0].get_desc().get_dims();
+    memory::dim total = 0;
+    for (const auto& part : parts) total += part.get_desc().get_dims().back();
+    const memory::dim rows = product(dims) / dims.back();
+    dims.back() = total;
+
+    memory out(plain_md(dims, memory::data_type::f32), eng);
+    float* dst = static_cast<float*>(out.get_data_handle());
+    memory::dim col = 0;
+    for (const auto& part : parts) {
+        auto part_dims = part.get_desc().get_dims();
+        memory plain = reorder_memory(part, plain_md(part_dims, memory::data_type::f32), eng);
+        const float* src = static_cast<const float*>(plain.get_data_handle());
+        const memory::dim n = part_dims.back();
+        for (memory::dim r = 0; r < rows; r++) {
+            std::memcpy(dst + r * total + col, src + r * n, sizeof(float) * n);
+        }
+        col += n;
+    }
+    return out;
+}
+
+// Bias a matmul accepts directly: same rank, each dim 1 or the dst's
+bool is_matmul_bias(const memory::desc& bias, const memory::desc& dst) {
+    auto b = bias.get_dims(), d = dst.get_dims();
+    if (b.size() != d.size()) return false;
+    for (size_t i = 0; i < b.size(); i++) {
+        if (b[i] != 1 && b[i] != d[i]) return false;
+    }
+    return true;
+}
+
+GraphOp make_op(GraphOp::Kind kind, const std::string& name, const std::vector<std::string>& inputs,
+    const std::vector<std::string>& outputs) {
+    GraphOp op;
+    op.kind = kind;
+    op.name = name;
+    op.inputs = inputs;
+    op.outputs = outputs;
+    return op;
+}
+
+} // namespace
+
+void OpGraph::matmul(const std::string& name, const std::string& src, const std::string& weights,
+    const std::string& dst, const AttrSpec& attr) {
+    GraphOp op = make_op(GraphOp::Kind::matmul, name, {src, weights}, {dst});
+    op.attr = attr;
+    ops.push_back(op);
+}
+
+void OpGraph::weight_matmul(const std::string& name, const std::string& src, const std::string& weights,
+    const std::string& dst) {
+    GraphOp op = make_op(GraphOp::Kind::matmul, name, {src, weights}, {dst});
+    op.weight_matmul = true;
+    ops.push_back(op);
+}
+
+void OpGraph::bias_add(const std::string& name, const std::string& src, const std::string& bias,
+    const std::string& dst) {
+    GraphOp op = make_op(GraphOp::Kind::bias_add, name, {src, bias}, {dst});
+    op.alg = algorithm::binary_add;
+    ops.push_back(op);
+}
+
+void OpGraph::eltwise(const std::string& name, const std::string& src, const std::string& dst,
+    algorithm alg, float alpha, float beta) {
+    GraphOp op = make_op(GraphOp::Kind::eltwise, name, {src}, {dst});
+    op.alg = alg;
+    op.alpha = alpha;
+    op.beta = beta;
+    ops.push_back(op);
+}
+
+void OpGraph::binary(const std::string& name, const std::string& src0, const std::string& src1,
+    const std::string& dst, algorithm alg) {
+    GraphOp op = make_op(GraphOp::Kind::binary, name, {src0, src1}, {dst});
+    op.alg = alg;
+    ops.push_back(op);
+}
+
+void OpGraph::scale(const std::string& name, const std::string& src, const std::string& dst, float factor) {
+    GraphOp op = make_op(GraphOp::Kind::scale, name, {src}, {dst});
+    op.alg = algorithm::eltwise_linear;
+    op.alpha = factor;
+    ops.push_back(op);
+}
+
+void OpGraph::softmax(const std::string& name, const std::string& src, const std::string& dst, int axis) {
+    GraphOp op = make_op(GraphOp::Kind::softmax, name, {src}, {dst});
+    op.axis = axis;
+    ops.push_back(op);
+}
+
+void OpGraph::layer_norm(const std::string& name, const std::string& src, const std::string& scale,
+    const std::string& shift, const std::string& dst, float epsilon) {
+    GraphOp op = make_op(GraphOp::Kind::layer_norm, name, {src, scale, shift}, {dst});
+    op.alpha = epsilon;
+    ops.push_back(op);
+}
+
+void OpGraph::custom(const std::string& name, const CustomOp& custom_op,
+    const std::vector<std::string>& inputs, const std::vector<std::string>& outputs) {
+    GraphOp op = make_op(GraphOp::Kind::custom, name, inputs, outputs);
+    op.custom_op = custom_op;
+    ops.push_back(op);
+}
+
+bool OpGraph::reads(const GraphOp& op, const std::string& tensor) const {
+    if (std::find(op.inputs.begin(), op.inputs.end(), tensor) != op.inputs.end()) return true;
+    if (op.bias == tensor) return true;
+    for (const auto& [idx, name] : op.post_op_inputs) {
+        if (name == tensor) return true;
+    }
+    return false;
+}
+
+bool OpGraph::writes(const GraphOp& op, const std::string& tensor) const {
+    return std::find(op.outputs.begin(), op.outputs.end(), tensor) != op.outputs.end();
+}
+
+bool OpGraph::aliased(const std::string& tensor) const {
+    const memory& mem = tensors.at(tensor);
+    auto* begin = static_cast<const uint8_t*>(mem.get_data_handle());
+    const uint8_t* end = begin + mem.get_desc().get_size();
+    for (const auto& [name, other] : tensors) {
+        if (name == tensor || !other) continue;
+        auto* ptr = static_cast<const uint8_t*>(other.get_data_handle());
+        if (ptr && ptr < end && begin < ptr + other.get_desc().get_size()) return true;
+    }
+    return false;
+}
+
+bool OpGraph::touched_by_custom(const std::string& tensor) const {
+    for (const auto& op : ops) {
+        if (op.kind == GraphOp::Kind::custom && (reads(op, tensor) || writes(op, tensor))) return true;
+    }
+    return false;
+}
+
+// Fold elementwise op `p` into matmul `m`, which produces its input. The op
+// effectively moves up to `m`, so nothing in between may touch what it
+// reads or writes.
+bool OpGraph::fold(size_t m, size_t p) {
+    GraphOp& mm = ops[m];
+    const GraphOp& op = ops[p];
+    const std::string& t = mm.outputs[0];
+    const std::string& d = op.outputs[0];
+    const std::string other = op.inputs.size() > 1 ? op.inputs[1] : "";
+    if (op.inputs[0] != t || other == t) return false;
+
+    for (size_t i = m + 1; i < p; i++) {
+        if (reads(ops[i], t) || writes(ops[i], t)) return false;
+        if (!other.empty() && writes(ops[i], other)) return false;
+        if (d != t && (reads(ops[i], d) || writes(ops[i], d))) return false;
+    }
+    if (d != t) {
+        // The matmul no longer writes t, so nobody may read it afterwards
+        if (outputs.count(t) || d == mm.inputs[0] || d == mm.inputs[1]) return false;
+        for (size_t i = p + 1; i < ops.size(); i++) {
+            if (reads(ops[i], t)) return false;
+            if (writes(ops[i], t)) break;
+        }
+    }
+    const auto t_md = tensors.at(t).get_desc();
+    const auto d_md = tensors.at(d).get_desc();
+    if (t_md.get_dims() != d_md.get_dims() || t_md.get_data_type() != d_md.get_data_type()) return false;
+
+    const int index = (int)mm.attr.post_ops.size();
+    switch (op.kind) {
+        case GraphOp::Kind::bias_add:
+            if (mm.bias.empty() && mm.attr.post_ops.empty() && is_matmul_bias(tensors.at(other).get_desc(), d_md)) {
+                mm.bias = other;
+            } else {
+                mm.attr.append_binary(algorithm::binary_add, tensors.at(other).get_desc());
+                mm.post_op_inputs.emplace_back(index, other);
+            }
+            break;
+        case GraphOp::Kind::binary:
+            mm.attr.append_binary(op.alg, tensors.at(other).get_desc());
+            mm.post_op_inputs.emplace_back(index, other);
+            break;
+        case GraphOp::Kind::eltwise:
+        case GraphOp::Kind::scale:
+            mm.attr.append_eltwise(op.alg, op.alpha, op.beta);
+            break;
+        default:
+            return false;
+    }
+    mm.outputs[0] = d;
+    mm.fused.push_back(op.name);
+    ops.erase(ops.begin() + p);
+    return true;
+}
+
+// Merge later weight matmuls reading the same src as `first` into it.
+// Their weights (and biases) are concatenated along N, the merged op
+// writes one wide tensor and the original outputs become strided views of
+// it. Outputs that share bytes with another tensor are left alone: views
+// into them (or the tensor they view) would keep the old buffer. Returns
+// the number of ops merged away.
+size_t OpGraph::merge_siblings(engine& eng, size_t first) {
+    GraphOp& a = ops[first];
+    if (!a.weight_matmul || !a.post_op_inputs.empty()) return 0;
+    const std::string src = a.inputs[0];
+    auto mergeable_output = [&](const std::string& name) {
+        return !outputs.count(name) && !views.count(name) && !touched_by_custom(name) && !aliased(name)
+            && tensors.at(name).get_desc() == plain_md(tensors.at(name).get_desc().get_dims(), memory::data_type::f32);
+    };
+    if (!mergeable_output(a.outputs[0])) return 0;
+
+    const auto a_wei = tensors.at(a.inputs[1]).get_desc().get_dims();
+    const auto a_out = tensors.at(a.outputs[0]).get_desc().get_dims();
+    std::vector<size_t> group = {first};
+    for (size_t b = first + 1; b < ops.size(); b++) {
+        if (writes(ops[b], src)) break;  // later readers see a different src
+        const GraphOp& c = ops[b];
+        if (c.kind != GraphOp::Kind::matmul || !c.weight_matmul || c.inputs[0] != src) continue;
+        if (!c.post_op_inputs.empty() || c.attr.to_string() != a.attr.to_string()
+            || c.bias.empty() != a.bias.empty() || !mergeable_output(c.outputs[0])) continue;
+        if (!same_except_last(tensors.at(c.inputs[1]).get_desc().get_dims(), a_wei)
+            || !same_except_last(tensors.at(c.outputs[0]).get_desc().get_dims(), a_out)) continue;
+        // c moves up to `first`; nothing in between may touch its output
+        bool independent = true;
+        for (size_t i = first + 1; i < b && independent; i++) {
+            independent = !reads(ops[i], c.outputs[0]) && !writes(ops[i], c.outputs[0]);
+        }
+        if (independent) group.push_back(b);
+    }
+    if (group.size() < 2) return 0;
+
+    std::string wei_name, bias_name;
+    for (size_t g : group) {
+        wei_name += (wei_name.empty() ? "" : "+") + ops[g].inputs[1];
+        if (!a.bias.empty()) bias_name += (bias_name.empty() ? "" : "+") + ops[g].bias;
+    }
+    // A merged weight kept from an earlier build (see ModelWeights) is
+    // reused as is, so pipelines built from the same weights share it
+    auto concat_parts = [&](const std::string& name, bool bias) {
+        if (name.empty() || tensors.count(name)) return;
+        std::vector<memory> parts;
+        for (size_t g : group) parts.push_back(tensors.at(bias ? ops[g].bias : ops[g].inputs[1]));
+        tensors[name] = concat_last_dim(eng, parts);
+    };
+    concat_parts(wei_name, false);
+    concat_parts(bias_name, true);
+
+    // One wide output; each original output becomes a column slice of it
+    memory::dim total = 0;
+    for (size_t g : group) total += tensors.at(ops[g].outputs[0]).get_desc().get_dims().back();
+    auto out_dims = a_out;
+    out_dims.back() = total;
+    const std::string out_name = a.outputs[0] + "_merged";
+    auto out_md = plain_md(out_dims, memory::data_type::f32);
+    tensors[out_name] = memory(out_md, eng);
+    memory::dim col = 0;
+    for (size_t g : group) {
+        const std::string& name = ops[g].outputs[0];
+        auto dims = tensors.at(name).get_desc().get_dims();
+        auto view_md = memory::desc(dims, memory::data_type::f32, out_md.get_strides());
+        tensors[name] = create_view(tensors.at(out_name), view_md, col * sizeof(float));
+        views.insert(name);
+        col += dims.back();
+    }
+
+    for (size_t i = 1; i < group.size(); i++) a.fused.push_back(ops[group[i]].name);
+    a.inputs[1] = wei_name;
+    a.bias = bias_name;
+    a.outputs[0] = out_name;
+    for (size_t i = group.size() - 1; i > 0; i--) ops.erase(ops.begin() + group[i]);
+    return group.size() - 1;
+}
+
+FusionStats OpGraph::fuse(engine& eng) {
+    FusionStats stats;
+    stats.ops_before = ops.size();
+
+    // Fold until nothing changes; each fold can expose the next
+    for (size_t p = 0; p < ops.size(); p++) {
+        if (!is_elementwise(ops[p].kind)) continue;
+        for (size_t m = p; m-- > 0;) {
+            if (!writes(ops[m], ops[p].inputs[0])) continue;
+            if (ops[m].kind == GraphOp::Kind::matmul && fold(m, p)) {
+                stats.folded++;
+                p = m;  // re-examine what follows the grown matmul
+            }
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (ops[i].kind == GraphOp::Kind::matmul) stats.merged += merge_siblings(eng, i);
+    }
+
+    stats.ops_after = ops.size();
+    LOG_INFO("Fusion: %zu ops -> %zu (%zu folded, %zu merged)\n",
+        stats.ops_before, stats.ops_after, stats.folded, stats.merged);
+    LOG_DEBUG("%s", to_string().c_str());
+    return stats;
+}
+
+void OpGraph::lower(engine& eng, PrimitivePipeline& model, PrimitiveCache& cache,
+    const AttrSpec& base, const MatmulLowering& lower_matmul) {
+    for (const auto& op : ops) {
+        switch (op.kind) {
+            case GraphOp::Kind::matmul: {
+                AttrSpec attr = op.attr;
+                attr.scratchpad = base.scratchpad;
+                attr.fpmath = base.fpmath;
+                attr.threads = base.threads;
+                std::unordered_map<int, memory> args;
+                for (const auto& [index, name] : op.post_op_inputs) {
+                    args[DNNL_ARG_ATTR_MULTIPLE_POST_OP(index) | DNNL_ARG_SRC_1] = tensors.at(name);
+                }
+                if (op.weight_matmul && lower_matmul) {
+                    lower_matmul(op, attr, args);
+                    break;
+                }
+                const std::string& wei = op.inputs[1];
+                auto wei_md = tensors.at(wei).get_desc();
+                auto mm = cache.get_matmul(eng,
+                    tensors.at(op.inputs[0]).get_desc(),
+                    op.weight_matmul ? any_layout(wei_md) : wei_md,
+                    op.bias.empty() ? memory::desc() : tensors.at(op.bias).get_desc(),
+                    tensors.at(op.outputs[0]).get_desc(),
+                    attr
+                );
+                if (op.weight_matmul) tensors[wei] = reorder_memory(tensors.at(wei), mm.pd.weights_desc(0), eng);
+                args[DNNL_ARG_SRC] = tensors.at(op.inputs[0]);
+                args[DNNL_ARG_WEIGHTS] = tensors.at(wei);
+                args[DNNL_ARG_DST] = tensors.at(op.outputs[0]);
+                if (!op.bias.empty()) args[DNNL_ARG_BIAS] = tensors.at(op.bias);
+                model.insert(mm, args, op.name);
+                break;
+            }
+            case GraphOp::Kind::bias_add:
+            case GraphOp::Kind::binary: {
+                auto p = cache.get_binary(eng,
+                    tensors.at(op.inputs[0]).get_desc(),
+                    tensors.at(op.inputs[1]).get_desc(),
+                    tensors.at(op.outputs[0]).get_desc(), op.alg, base);
+                model.insert(p, {
+                    {DNNL_ARG_SRC_0, tensors.at(op.inputs[0])},
+                    {DNNL_ARG_SRC_1, tensors.at(op.inputs[1])},
+                    {DNNL_ARG_DST, tensors.at(op.outputs[0])}
+                }, op.name);
+                break;
+            }
+            case GraphOp::Kind::eltwise:
+            case GraphOp::Kind::scale: {
+                auto p = cache.get_eltwise(eng,
+                    tensors.at(op.inputs[0]).get_desc(),
+                    tensors.at(op.outputs[0]).get_desc(), op.alg, op.alpha, op.beta, base);
+                model.insert(p, {
+                    {DNNL_ARG_SRC, tensors.at(op.inputs[0])},
+                    {DNNL_ARG_DST, tensors.at(op.outputs[0])}
+                }, op.name);
+                break;
+            }
+            case GraphOp::Kind::softmax: {
+                auto p = cache.get_softmax(eng,
+                    tensors.at(op.inputs[0]).get_desc(),
+                    tensors.at(op.outputs[0]).get_desc(), op.axis, base);
+                model.insert(p, {
+                    {DNNL_ARG_SRC, tensors.at(op.inputs[0])},
+                    {DNNL_ARG_DST, tensors.at(op.outputs[0])}
+                }, op.name);
+                break;
+            }
+            case GraphOp::Kind::layer_norm: {
+                auto p = cache.get_layer_norm(eng,
+                    tensors.at(op.inputs[0]).get_desc(),
+                    tensors.at(op.outputs[0]).get_desc(), op.alpha,
+                    normalization_flags::use_scale | normalization_flags::use_shift, base);
+                model.insert(p, {
+                    {DNNL_ARG_SRC, tensors.at(op.inputs[0])},
+                    {DNNL_ARG_SCALE, tensors.at(op.inputs[1])},
+                    {DNNL_ARG_SHIFT, tensors.at(op.inputs[2])},
+                    {DNNL_ARG_DST, tensors.at(op.outputs[0])}
+                }, op.name);
+                break;
+            }
+            case GraphOp::Kind::custom: {
+                std::unordered_map<int, memory> args;
+                for (size_t i = 0; i < op.inputs.size(); i++) args[DNNL_ARG_MULTIPLE_SRC + (int)i] = tensors.at(op.inputs[i]);
+                for (size_t i = 0; i < op.outputs.size(); i++) args[DNNL_ARG_MULTIPLE_DST + (int)i] = tensors.at(op.outputs[i]);
+                model.insert_custom(op.custom_op, args, op.name);
+                break;
+            }
+        }
+    }
+}
+
+std::string OpGraph::to_string() const {
+    std::string out;
+    for (const auto& op : ops) {
+        out += op.name + " = " + kind_name(op.kind) + "(";
+        for (size_t i = 0; i < op.inputs.size(); i++) out += (i ? ", " : "") + op.inputs[i];
+        if (!op.bias.empty()) out += ", bias=" + op.bias;
+        out += ") -> ";
+        for (size_t i = 0; i < op.outputs.size(); i++) out += (i ? ", " : "") + op.outputs[i];
+        if (!op.attr.post_ops.empty()) out += " [" + op.attr.to_string() + "]";
+        if (!op.fused.empty()) {
+            out += " fused:";
+            for (const auto& name : op.fused) out += " " + name;
+        }
+        out += "\n";
+    }
+    return out;
+}
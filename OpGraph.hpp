@@ -0,0 +1,111 @@
+#ifndef OP_GRAPH_HPP
+#define OP_GRAPH_HPP
+
+#include "oneapi/dnnl/dnnl.hpp"
+#include "PrimitiveCache.hpp"
+#include "PrimitivePipeline.hpp"
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// One node of an OpGraph. Inputs and outputs are tensor names in the
+// graph's tensor map; an op may write the tensor it reads (in place).
+struct GraphOp {
+    enum class Kind { matmul, bias_add, eltwise, binary, scale, softmax, layer_norm, custom };
+
+    Kind kind = Kind::custom;
+    std::string name;
+    std::vector<std::string> inputs;   // matmul: src, weights; bias_add: src, bias; binary: src0, src1;
+                                       // layer_norm: src, scale, shift
+    std::vector<std::string> outputs;
+    dnnl::algorithm alg = dnnl::algorithm::undef;  // eltwise, binary
+    float alpha = 0.0f;                // eltwise alpha, scale factor, layer_norm epsilon
+    float beta = 0.0f;
+    int axis = 0;                      // softmax
+    CustomOp custom_op;                // custom
+
+    // Matmul only. Weight matmuls multiply by a model weight (constant, so
+    // it can be reordered, converted or concatenated at build time).
+    bool weight_matmul = false;
+    std::string bias;
+    AttrSpec attr;
+    std::vector<std::pair<int, std::string>> post_op_inputs;  // (post-op index, binary src1)
+    std::vector<std::string> fused;    // ops folded or merged into this one
+};
+
+struct FusionStats {
+    size_t ops_before = 0;
+    size_t ops_after = 0;
+    size_t folded = 0;  // elementwise ops turned into bias/post-ops
+    size_t merged = 0;  // sibling matmuls merged into another
+};
+
+// Lowers a weight matmul with the fused `attr` and post-op `args`. Lets
+// the caller apply model-wide policies (precision, weight sharing).
+using MatmulLowering = std::function<void(const GraphOp& op, const AttrSpec& attr,
+    const std::unordered_map<int, dnnl::memory>& args)>;
+
+// Dataflow description of a model section. Builders add ops by tensor
+// name, fuse() rewrites the op list and lower() turns it into primitives.
+class OpGraph {
+public:
+    explicit OpGraph(std::map<std::string, dnnl::memory>& tensors) : tensors(tensors) {}
+
+    void matmul(const std::string& name, const std::string& src, const std::string& weights,
+        const std::string& dst, const AttrSpec& attr = AttrSpec());
+    void weight_matmul(const std::string& name, const std::string& src, const std::string& weights,
+        const std::string& dst);
+    void bias_add(const std::string& name, const std::string& src, const std::string& bias, const std::string& dst);
+    void eltwise(const std::string& name, const std::string& src, const std::string& dst,
+        dnnl::algorithm alg, float alpha = 0.0f, float beta = 0.0f);
+    void binary(const std::string& name, const std::string& src0, const std::string& src1,
+        const std::string& dst, dnnl::algorithm alg);
+    void scale(const std::string& name, const std::string& src, const std::string& dst, float factor);
+    void softmax(const std::string& name, const std::string& src, const std::string& dst, int axis);
+    // Normalizes over the last dim, then applies per-channel scale/shift
+    void layer_norm(const std::string& name, const std::string& src, const std::string& scale,
+        const std::string& shift, const std::string& dst, float epsilon);
+    // Custom ops may keep memory objects in their state, so fusion never
+    // renames or re-views tensors they touch
+    void custom(const std::string& name, const CustomOp& custom_op,
+        const std::vector<std::string>& inputs, const std::vector<std::string>& outputs);
+
+    // Tensors read after the graph runs; they are never fused away
+    void mark_output(const std::string& name) { outputs.insert(name); }
+
+    // Fold bias/eltwise/binary/scale ops into the matmul producing their
+    // input, then merge weight matmuls that read the same src into one
+    // matmul over concatenated weights.
+    FusionStats fuse(dnnl::engine& eng);
+
+    // Append the ops to `model`. Weight matmuls go through `lower_matmul`
+    // when given; otherwise their weights are reordered in place.
+    void lower(dnnl::engine& eng, PrimitivePipeline& model, PrimitiveCache& cache,
+        const AttrSpec& base, const MatmulLowering& lower_matmul = nullptr);
+
+    const std::vector<GraphOp>& get_ops() const { return ops; }
+    // Tensors that merging turned into views of a merged output; they must
+    // not be planned as separate activations
+    const std::set<std::string>& get_views() const { return views; }
+    std::string to_string() const;
+
+private:
+    bool reads(const GraphOp& op, const std::string& tensor) const;
+    bool writes(const GraphOp& op, const std::string& tensor) const;
+    bool touched_by_custom(const std::string& tensor) const;
+    // True if another tensor shares bytes with `tensor` (views either way)
+    bool aliased(const std::string& tensor) const;
+    bool fold(size_t m, size_t p);
+    size_t merge_siblings(dnnl::engine& eng, size_t first);
+
+    std::map<std::string, dnnl::memory>& tensors;
+    std::vector<GraphOp> ops;
+    std::set<std::string> outputs;
+    std::set<std::string> views;
+};
+
+#endif // OP_GRAPH_HPP
@@ -0,0 +1,551 @@
+#include "PrimitiveCache.hpp"
+#include "Logging.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace dnnl;
+
+namespace {
+
+std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> parts;
+    std::string part;
+    std::istringstream in(s);
+    while (std::getline(in, part, sep)) parts.push_back(part);
+    return parts;
+}
+
+std::string dims_to_string(const memory::dims& dims) {
+    std::string out;
+    for (size_t i = 0; i < dims.size(); i++) {
+        if (i) out += "x";
+        out += std::to_string(dims[i]);
+    }
+    return out;
+}
+
+memory::dims dims_from_string(const std::string& s) {
+    memory::dims dims;
+    for (const auto& d : split(s, 'x')) dims.push_back(std::stoll(d));
+    return dims;
+}
+
+std::string float_to_string(float f) {
+    std::ostringstream out;
+    out << std::hexfloat << f;
+    return out.str();
+}
+
+// Inverse of md_to_string. Returns false for layouts that cannot be rebuilt
+// through the public API (blocked/opaque).
+bool md_from_string(const std::string& s, memory::desc& md) {
+    if (s == "-") {
+        md = memory::desc();
+        return true;
+    }
+    auto fields = split(s, ':');
+    if (fields.size() != 3) return false;
+    auto dt = static_cast<memory::data_type>(std::stoi(fields[0]));
+    auto dims = dims_from_string(fields[1]);
+    if (fields[2] == "any") {
+        md = memory::desc(dims, dt, memory::format_tag::any);
+        return true;
+    }
+    if (fields[2].compare(0, 1, "s") != 0) return false;
+    md = memory::desc(dims, dt, dims_from_string(fields[2].substr(1)));
+    return true;
+}
+
+bool attr_from_string(const std::string& s, AttrSpec& attr) {
+    attr = AttrSpec();
+    for (const auto& field : split(s, ';')) {
+        auto eq = field.find('=');
+        if (eq == std::string::npos) return false;
+        std::string name = field.substr(0, eq);
+        std::string value = field.substr(eq + 1);
+        if (name == "sp") {
+            attr.scratchpad = value == "u" ? scratchpad_mode::user : scratchpad_mode::library;
+        } else if (name == "fm") {
+            attr.fpmath = static_cast<fpmath_mode>(std::stoi(value));
+        } else if (name == "th") {
+            attr.threads = std::stoi(value);
+        } else if (name == "po") {
+            for (const auto& po : split(value, ',')) {
+                auto p = split(po, '/');
+                if (p.empty()) return false;
+                if (p[0] == "e" && p.size() == 4) {
+                    attr.append_eltwise(static_cast<algorithm>(std::stoi(p[1])),
+                        std::strtof(p[2].c_str(), nullptr), std::strtof(p[3].c_str(), nullptr));
+                } else if (p[0] == "b" && p.size() == 3) {
+                    memory::desc src1;
+                    if (!md_from_string(p[2], src1)) return false;
+                    attr.append_binary(static_cast<algorithm>(std::stoi(p[1])), src1);
+                } else if (p[0] == "s" && p.size() == 2) {
+                    attr.append_sum(std::strtof(p[1].c_str(), nullptr));
+                } else {
+                    return false;
+                }
+            }
+        } else if (name == "sc" || name == "zp") {
+            auto& target = name == "sc" ? attr.scales : attr.zero_points;
+            for (const auto& am : split(value, ',')) {
+                auto p = split(am, ':');
+                if (p.size() != 2) return false;
+                target.emplace_back(std::stoi(p[0]), std::stoi(p[1]));
+            }
+        }
+    }
+    return true;
+}
+
+// Create a primitive, from its cache blob when there is one
+template <typename Prim>
+CachedPrimitive create_primitive(const typename Prim::primitive_desc& pd, const std::vector<uint8_t>* blob) {
+    if (blob && !blob->empty()) {
+        try {
+            return CachedPrimitive{Prim(pd, *blob), pd, {}};
+        } catch (const dnnl::error& e) {
+            LOG_WARN("Cache blob rejected (%s), compiling instead\n", e.what());
+        }
+    }
+    return CachedPrimitive{Prim(pd), pd, {}};
+}
+
+// Limit the calling thread's OpenMP team while a primitive is created
+class ThreadLimit {
+public:
+    explicit ThreadLimit(int threads) {
+#ifdef _OPENMP
+        if (threads > 0) {
+            saved = omp_get_max_threads();
+            omp_set_num_threads(threads);
+        }
+#endif
+        (void)threads;
+    }
+    ~ThreadLimit() {
+#ifdef _OPENMP
+        if (saved > 0) omp_set_num_threads(saved);
+#endif
+    }
+    ThreadLimit(const ThreadLimit&) = delete;
+    ThreadLimit& operator=(const ThreadLimit&) = delete;
+
+private:
+    int saved = 0;
+};
+
+const char compiled_magic[8] = {'D', 'N', 'N', 'L', 'P', 'C', 'C', '1'};
+const uint32_t compiled_version = 1;
+
+template <typename T>
+void put(std::ostream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T get(std::istream& in) {
+    T value;
+    if (!in.read(reinterpret_cast<char*>(&value), sizeof(T))) throw std::runtime_error("compiled cache is truncated");
+    return value;
+}
+
+std::string engine_key(const engine& eng) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "@%p", eng.get());
+    return buf;
+}
+
+} // namespace
+
+std::string md_to_string(const memory::desc& md) {
+    if (md.is_zero()) return "-";
+    std::string out = std::to_string(static_cast<int>(md.get_data_type())) + ":"
+        + dims_to_string(md.get_dims()) + ":";
+    if (md.get_format_kind() == memory::format_kind::any) return out + "any";
+    if (md.get_format_kind() != memory::format_kind::blocked) return out + "opaque";
+    out += (md.get_inner_nblks() == 0 ? "s" : "blk") + dims_to_string(md.get_strides());
+    if (md.get_inner_nblks() != 0) {
+        out += "/" + dims_to_string(md.get_inner_blks()) + "/" + dims_to_string(md.get_inner_idxs());
+    }
+    return out;
+}
+
+AttrSpec& AttrSpec::append_eltwise(algorithm alg, float alpha, float beta) {
+    post_ops.push_back({PostOpKind::eltwise, alg, alpha, beta, memory::desc()});
+    return *this;
+}
+
+AttrSpec& AttrSpec::append_binary(algorithm alg, const memory::desc& src1) {
+    post_ops.push_back({PostOpKind::binary, alg, 0.0f, 0.0f, src1});
+    return *this;
+}
+
+AttrSpec& AttrSpec::append_sum(float scale) {
+    post_ops.push_back({PostOpKind::sum, algorithm::undef, scale, 0.0f, memory::desc()});
+    return *this;
+}
+
+primitive_attr AttrSpec::to_primitive_attr() const {
+    primitive_attr attr;
+    dnnl::post_ops ops;
+    for (const auto& po : post_ops) {
+        switch (po.kind) {
+            case PostOpKind::eltwise: ops.append_eltwise(po.alg, po.alpha, po.beta); break;
+            case PostOpKind::binary: ops.append_binary(po.alg, po.src1); break;
+            case PostOpKind::sum: ops.append_sum(po.alpha); break;
+        }
+    }
+    attr.set_post_ops(ops);
+    for (const auto& [arg, mask] : scales) attr.set_scales_mask(arg, mask);
+    for (const auto& [arg, mask] : zero_points) attr.set_zero_points_mask(arg, mask);
+    attr.set_scratchpad_mode(scratchpad);
+    attr.set_fpmath_mode(fpmath);
+    return attr;
+}
+
+std::string AttrSpec::to_string() const {
+    std::string out = std::string("sp=") + (scratchpad == scratchpad_mode::user ? "u" : "l")
+        + ";fm=" + std::to_string(static_cast<int>(fpmath));
+    if (!post_ops.empty()) {
+        out += ";po=";
+        for (size_t i = 0; i < post_ops.size(); i++) {
+            const auto& po = post_ops[i];
+            if (i) out += ",";
+            switch (po.kind) {
+                case PostOpKind::eltwise:
+                    out += "e/" + std::to_string(static_cast<int>(po.alg)) + "/"
+                        + float_to_string(po.alpha) + "/" + float_to_string(po.beta);
+                    break;
+                case PostOpKind::binary:
+                    out += "b/" + std::to_string(static_cast<int>(po.alg)) + "/" + md_to_string(po.src1);
+                    break;
+                case PostOpKind::sum:
+                    out += "s/" + float_to_string(po.alpha);
+                    break;
+            }
+        }
+    }
+    auto masks = [&](const char* name, const std::vector<std::pair<int, int>>& v) {
+        if (v.empty()) return;
+        out += std::string(";") + name + "=";
+        for (size_t i = 0; i < v.size(); i++) {
+            if (i) out += ",";
+            out += std::to_string(v[i].first) + ":" + std::to_string(v[i].second);
+        }
+    };
+    masks("sc", scales);
+    masks("zp", zero_points);
+    if (threads > 0) out += ";th=" + std::to_string(threads);
+    return out;
+}
+
+PrimitiveCache& PrimitiveCache::global() {
+    static PrimitiveCache cache;
+    return cache;
+}
+
+template <typename Create>
+CachedPrimitive PrimitiveCache::lookup(const engine& eng, const std::string& spec, int threads, Create create) {
+    const std::string key = spec + engine_key(eng);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            stats_.hits++;
+            return it->second.cached;
+        }
+    }
+
+    // Create outside the lock so a slow JIT doesn't block other builders.
+    // The blob is held by reference count, so load_compiled may replace it.
+    std::shared_ptr<const std::vector<uint8_t>> blob;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = blobs_.find(key);
+        if (it != blobs_.end()) blob = it->second;
+    }
+    auto start = std::chrono::steady_clock::now();
+    CachedPrimitive created;
+    {
+        ThreadLimit limit(threads);
+        created = create(blob.get());
+    }
+    created.spec = spec;
+    double ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.misses++;
+    stats_.creation_ms += ms;
+    auto [it, inserted] = entries_.emplace(key, Entry{created, spec});
+    if (inserted) order_.push_back(spec);
+    return it->second.cached;
+}
+
+CachedPrimitive PrimitiveCache::get_matmul(const engine& eng,
+    const memory::desc& src, const memory::desc& weights,
+    const memory::desc& bias, const memory::desc& dst, const AttrSpec& attr) {
+
+    std::string spec = "matmul " + md_to_string(src) + " " + md_to_string(weights) + " "
+        + md_to_string(bias) + " " + md_to_string(dst) + " " + attr.to_string();
+
+    return lookup(eng, spec, attr.threads, [&](const std::vector<uint8_t>* blob) {
+        auto pd = bias.is_zero()
+            ? matmul::primitive_desc(eng, src, weights, dst, attr.to_primitive_attr())
+            : matmul::primitive_desc(eng, src, weights, bias, dst, attr.to_primitive_attr());
+        return create_primitive<matmul>(pd, blob);
+    });
+}
+
+CachedPrimitive PrimitiveCache::get_softmax(const engine& eng,
+    const memory::desc& src, const memory::desc& dst, int axis, const AttrSpec& attr) {
+
+    std::string spec = "softmax " + md_to_string(src) + " " + md_to_string(dst) + " "
+        + std::to_string(axis) + " " + attr.to_string();
+
+    return lookup(eng, spec, attr.threads, [&](const std::vector<uint8_t>* blob) {
+        auto pd = softmax_forward::primitive_desc(eng, prop_kind::forward_inference,
+            algorithm::softmax_accurate, src, dst, axis, attr.to_primitive_attr());
+        return create_primitive<softmax_forward>(pd, blob);
+    });
+}
+
+CachedPrimitive PrimitiveCache::get_eltwise(const engine& eng,
+    const memory::desc& src, const memory::desc& dst, algorithm alg, float alpha, float beta,
+    const AttrSpec& attr) {
+
+    std::string spec = "eltwise " + md_to_string(src) + " " + md_to_string(dst) + " "
+        + std::to_string(static_cast<int>(alg)) + "/" + float_to_string(alpha) + "/" + float_to_string(beta)
+        + " " + attr.to_string();
+
+    return lookup(eng, spec, attr.threads, [&](const std::vector<uint8_t>* blob) {
+        auto pd = eltwise_forward::primitive_desc(eng, prop_kind::forward_inference,
+            alg, src, dst, alpha, beta, attr.to_primitive_attr());
+        return create_primitive<eltwise_forward>(pd, blob);
+    });
+}
+
+CachedPrimitive PrimitiveCache::get_binary(const engine& eng,
+    const memory::desc& src0, const memory::desc& src1, const memory::desc& dst, algorithm alg,
+    const AttrSpec& attr) {
+
+    std::string spec = "binary " + md_to_string(src0) + " " + md_to_string(src1) + " " + md_to_string(dst) + " "
+        + std::to_string(static_cast<int>(alg)) + " " + attr.to_string();
+
+    return lookup(eng, spec, attr.threads, [&](const std::vector<uint8_t>* blob) {
+        auto pd = binary::primitive_desc(eng, alg, src0, src1, dst, attr.to_primitive_attr());
+        return create_primitive<binary>(pd, blob);
+    });
+}
+
+CachedPrimitive PrimitiveCache::get_layer_norm(const engine& eng,
+    const memory::desc& src, const memory::desc& dst, float epsilon, normalization_flags flags,
+    const AttrSpec& attr) {
+
+    std::string spec = "layer_norm " + md_to_string(src) + " " + md_to_string(dst) + " "
+        + float_to_string(epsilon) + "/" + std::to_string(static_cast<unsigned>(flags)) + " " + attr.to_string();
+
+    return lookup(eng, spec, attr.threads, [&](const std::vector<uint8_t>* blob) {
+        auto pd = layer_normalization_forward::primitive_desc(eng, prop_kind::forward_inference,
+            src, dst, epsilon, flags, attr.to_primitive_attr());
+        return create_primitive<layer_normalization_forward>(pd, blob);
+    });
+}
+
+CachedPrimitive PrimitiveCache::get_reorder(const engine& eng,
+    const memory::desc& src, const memory::desc& dst, const AttrSpec& attr) {
+
+    std::string spec = "reorder " + md_to_string(src) + " " + md_to_string(dst) + " " + attr.to_string();
+
+    return lookup(eng, spec, attr.threads, [&](const std::vector<uint8_t>* blob) {
+        auto pd = reorder::primitive_desc(eng, src, eng, dst, attr.to_primitive_attr());
+        return create_primitive<reorder>(pd, blob);
+    });
+}
+
+PrimitiveCache::Stats PrimitiveCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats s = stats_;
+    s.entries = entries_.size();
+    return s;
+}
+
+void PrimitiveCache::print_stats() const {
+    Stats s = stats();
+    printf("[CACHE] entries=%zu hits=%zu misses=%zu creation=%.2f ms\n",
+        s.entries, s.hits, s.misses, s.creation_ms);
+}
+
+void PrimitiveCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    order_.clear();
+    blobs_.clear();
+    stats_ = Stats();
+}
+
+void PrimitiveCache::save_warm_list(const std::string& path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("cannot open warm list for writing: " + path);
+    for (const auto& spec : order_) out << spec << "\n";
+}
+
+size_t PrimitiveCache::load_warm_list(const engine& eng, const std::string& path) {
+    std::ifstream in(path);
+    if (!in) return 0;
+
+    size_t loaded = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!warm_entry(eng, line).spec.empty()) loaded++;
+    }
+    return loaded;
+}
+
+CachedPrimitive PrimitiveCache::get_for_threads(const engine& eng, const std::string& spec, int threads) {
+    // The attributes are the last field; replace their thread count
+    auto fields = split(spec, ' ');
+    AttrSpec attr;
+    if (fields.size() < 2 || !attr_from_string(fields.back(), attr)) {
+        throw std::invalid_argument("not a primitive spec: " + spec);
+    }
+    attr.threads = threads;
+    fields.back() = attr.to_string();
+    std::string line = fields[0];
+    for (size_t i = 1; i < fields.size(); i++) line += " " + fields[i];
+    CachedPrimitive cached = warm_entry(eng, line);
+    if (cached.spec.empty()) throw std::runtime_error("cannot recreate primitive: " + spec);
+    return cached;
+}
+
+CachedPrimitive PrimitiveCache::warm_entry(const engine& eng, const std::string& line) {
+    auto f = split(line, ' ');
+    AttrSpec attr;
+    memory::desc src, weights, bias, dst;
+    try {
+        if (f.size() == 6 && f[0] == "matmul"
+            && md_from_string(f[1], src) && md_from_string(f[2], weights)
+            && md_from_string(f[3], bias) && md_from_string(f[4], dst)
+            && attr_from_string(f[5], attr)) {
+            return get_matmul(eng, src, weights, bias, dst, attr);
+        } else if (f.size() == 5 && f[0] == "softmax"
+            && md_from_string(f[1], src) && md_from_string(f[2], dst)
+            && attr_from_string(f[4], attr)) {
+            return get_softmax(eng, src, dst, std::stoi(f[3]), attr);
+        } else if (f.size() == 5 && f[0] == "eltwise"
+            && md_from_string(f[1], src) && md_from_string(f[2], dst)
+            && attr_from_string(f[4], attr)) {
+            auto p = split(f[3], '/');
+            if (p.size() != 3) throw std::invalid_argument("bad eltwise parameters");
+            return get_eltwise(eng, src, dst, static_cast<algorithm>(std::stoi(p[0])),
+                std::strtof(p[1].c_str(), nullptr), std::strtof(p[2].c_str(), nullptr), attr);
+        } else if (f.size() == 6 && f[0] == "binary"
+            && md_from_string(f[1], src) && md_from_string(f[2], weights)
+            && md_from_string(f[3], dst) && attr_from_string(f[5], attr)) {
+            return get_binary(eng, src, weights, dst, static_cast<algorithm>(std::stoi(f[4])), attr);
+        } else if (f.size() == 5 && f[0] == "layer_norm"
+            && md_from_string(f[1], src) && md_from_string(f[2], dst)
+            && attr_from_string(f[4], attr)) {
+            auto p = split(f[3], '/');
+            if (p.size() != 2) throw std::invalid_argument("bad layer_norm parameters");
+            return get_layer_norm(eng, src, dst, std::strtof(p[0].c_str(), nullptr),
+                static_cast<normalization_flags>(std::stoul(p[1])), attr);
+        } else if (f.size() == 4 && f[0] == "reorder"
+            && md_from_string(f[1], src) && md_from_string(f[2], dst)
+            && attr_from_string(f[3], attr)) {
+            return get_reorder(eng, src, dst, attr);
+        } else {
+            LOG_WARN("Skipping warm list entry: %s\n", line.c_str());
+            return CachedPrimitive();
+        }
+    } catch (const std::exception& e) {
+        LOG_WARN("Failed to warm entry (%s): %s\n", e.what(), line.c_str());
+        return CachedPrimitive();
+    }
+}
+
+void PrimitiveCache::save_compiled(const std::string& path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ofstream out(path, std::ios::binary);
+    if (!out) throw std::runtime_error("cannot open compiled cache for writing: " + path);
+    out.write(compiled_magic, sizeof(compiled_magic));
+    put(out, compiled_version);
+    put(out, static_cast<uint32_t>(order_.size()));
+
+    // One entry per spec, in creation order
+    std::unordered_map<std::string, const Entry*> by_spec;
+    for (const auto& [key, entry] : entries_) by_spec.emplace(entry.spec, &entry);
+    size_t with_blob = 0;
+    for (const auto& spec : order_) {
+        std::vector<uint8_t> blob;
+        try {
+            blob = by_spec.at(spec)->cached.prim.get_cache_blob();
+        } catch (const dnnl::error&) {
+            // Not supported by this engine
+        }
+        with_blob += !blob.empty();
+        put(out, static_cast<uint32_t>(spec.size()));
+        out.write(spec.data(), spec.size());
+        put(out, static_cast<uint64_t>(blob.size()));
+        out.write(reinterpret_cast<const char*>(blob.data()), blob.size());
+    }
+    if (!out) throw std::runtime_error("failed to write compiled cache: " + path);
+    LOG_INFO("Compiled cache: %zu primitives, %zu with cache blobs\n", order_.size(), with_blob);
+}
+
+size_t PrimitiveCache::load_compiled(const engine& eng, const std::string& path, int threads) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return 0;
+
+    char file_magic[sizeof(compiled_magic)];
+    if (!in.read(file_magic, sizeof(file_magic)) || std::memcmp(file_magic, compiled_magic, sizeof(file_magic)) != 0) {
+        throw std::runtime_error("not a compiled primitive cache: " + path);
+    }
+    if (get<uint32_t>(in) != compiled_version) {
+        throw std::runtime_error("unsupported compiled cache version: " + path);
+    }
+    const uint32_t count = get<uint32_t>(in);
+    std::vector<std::string> specs(count);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& spec : specs) {
+            spec.resize(get<uint32_t>(in));
+            if (!in.read(&spec[0], spec.size())) throw std::runtime_error("compiled cache is truncated");
+            std::vector<uint8_t> blob(get<uint64_t>(in));
+            if (!in.read(reinterpret_cast<char*>(blob.data()), blob.size())) {
+                throw std::runtime_error("compiled cache is truncated");
+            }
+            if (!blob.empty()) {
+                blobs_[spec + engine_key(eng)] = std::make_shared<const std::vector<uint8_t>>(std::move(blob));
+            }
+        }
+    }
+
+    // Descriptor creation (and JIT without blobs) is independent per entry
+    if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<int>(threads, (int)specs.size());
+    std::atomic<size_t> next{0}, loaded{0};
+    auto work = [&]() {
+        for (size_t i = next++; i < specs.size(); i = next++) {
+            if (!warm_entry(eng, specs[i]).spec.empty()) loaded++;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) pool.emplace_back(work);
+    work();
+    for (auto& t : pool) t.join();
+    return loaded;
+}
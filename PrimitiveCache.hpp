@@ -0,0 +1,141 @@
+#ifndef PRIMITIVE_CACHE_HPP
+#define PRIMITIVE_CACHE_HPP
+
+#include "oneapi/dnnl/dnnl.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Primitive attributes in a form the cache can key on and persist.
+// oneDNN does not expose getters for scale/zero-point masks, so builders
+// describe attributes here and the cache turns them into a primitive_attr.
+struct AttrSpec {
+    enum class PostOpKind { eltwise, binary, sum };
+    struct PostOp {
+        PostOpKind kind;
+        dnnl::algorithm alg = dnnl::algorithm::undef;
+        float alpha = 0.0f;
+        float beta = 0.0f;
+        dnnl::memory::desc src1;  // binary only
+    };
+
+    std::vector<PostOp> post_ops;
+    std::vector<std::pair<int, int>> scales;       // (DNNL_ARG_*, mask)
+    std::vector<std::pair<int, int>> zero_points;  // (DNNL_ARG_*, mask)
+    dnnl::scratchpad_mode scratchpad = dnnl::scratchpad_mode::library;
+    dnnl::fpmath_mode fpmath = dnnl::fpmath_mode::strict;
+    // Create the primitive for this many OpenMP threads (0 = the caller's
+    // omp_get_max_threads()); oneDNN fixes a primitive's team size then
+    int threads = 0;
+
+    AttrSpec& append_eltwise(dnnl::algorithm alg, float alpha, float beta);
+    AttrSpec& append_binary(dnnl::algorithm alg, const dnnl::memory::desc& src1);
+    AttrSpec& append_sum(float scale = 1.0f);
+
+    dnnl::primitive_attr to_primitive_attr() const;
+    std::string to_string() const;
+};
+
+// A cached primitive together with the descriptor it was created from, so
+// callers can still query layouts (weights_desc, scratchpad_desc, ...), and
+// the spec (warm list line) that recreates it.
+struct CachedPrimitive {
+    dnnl::primitive prim;
+    dnnl::primitive_desc_base pd;
+    std::string spec;
+};
+
+// Process-wide cache of created primitives keyed on op kind, memory descs
+// and attributes. Identical layers (Q/K/V, experts, repeated blocks) share
+// one primitive and a rebuilt model skips primitive creation entirely.
+class PrimitiveCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        double creation_ms = 0.0;  // total time spent creating on misses
+        size_t entries = 0;
+    };
+
+    static PrimitiveCache& global();
+
+    // Pass a zero memory::desc() as bias for a matmul without bias.
+    CachedPrimitive get_matmul(const dnnl::engine& eng,
+        const dnnl::memory::desc& src, const dnnl::memory::desc& weights,
+        const dnnl::memory::desc& bias, const dnnl::memory::desc& dst,
+        const AttrSpec& attr = AttrSpec());
+
+    CachedPrimitive get_softmax(const dnnl::engine& eng,
+        const dnnl::memory::desc& src, const dnnl::memory::desc& dst,
+        int axis, const AttrSpec& attr = AttrSpec());
+
+    CachedPrimitive get_eltwise(const dnnl::engine& eng,
+        const dnnl::memory::desc& src, const dnnl::memory::desc& dst,
+        dnnl::algorithm alg, float alpha, float beta, const AttrSpec& attr = AttrSpec());
+
+    CachedPrimitive get_binary(const dnnl::engine& eng,
+        const dnnl::memory::desc& src0, const dnnl::memory::desc& src1, const dnnl::memory::desc& dst,
+        dnnl::algorithm alg, const AttrSpec& attr = AttrSpec());
+
+    // Inference layer norm over the last dim; no mean/variance outputs
+    CachedPrimitive get_layer_norm(const dnnl::engine& eng,
+        const dnnl::memory::desc& src, const dnnl::memory::desc& dst,
+        float epsilon, dnnl::normalization_flags flags, const AttrSpec& attr = AttrSpec());
+
+    // Layout/data type conversion, e.g. f32 -> u8 with DST scales for int8
+    CachedPrimitive get_reorder(const dnnl::engine& eng,
+        const dnnl::memory::desc& src, const dnnl::memory::desc& dst,
+        const AttrSpec& attr = AttrSpec());
+
+    // The primitive `spec` (CachedPrimitive::spec) describes, created for
+    // `threads` OpenMP threads, e.g. for a branch that runs on a partition
+    // of the cores. Cached under its own key.
+    CachedPrimitive get_for_threads(const dnnl::engine& eng, const std::string& spec, int threads);
+
+    Stats stats() const;
+    void print_stats() const;
+    void clear();
+
+    // Warm list: one line per cached primitive describing how to recreate
+    // it. Loading it at startup creates (and JITs) everything up front.
+    void save_warm_list(const std::string& path) const;
+    size_t load_warm_list(const dnnl::engine& eng, const std::string& path);
+
+    // Compiled cache: the warm list plus each primitive's cache blob
+    // (primitive::get_cache_blob). Loading recreates the descriptors on
+    // `threads` threads (0 = all cores) and builds the primitives from their
+    // blobs, so no kernel is generated again. Engines without blob support
+    // store none and compile as on a warm-list load; a blob the library
+    // rejects (other version or ISA) falls back the same way.
+    void save_compiled(const std::string& path) const;
+    size_t load_compiled(const dnnl::engine& eng, const std::string& path, int threads = 0);
+
+private:
+    struct Entry {
+        CachedPrimitive cached;
+        std::string spec;
+    };
+
+    template <typename Create>
+    CachedPrimitive lookup(const dnnl::engine& eng, const std::string& spec, int threads, Create create);
+    // Recreate one warm-list entry; an empty spec if it is not understood
+    CachedPrimitive warm_entry(const dnnl::engine& eng, const std::string& spec);
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::vector<std::string> order_;  // specs in creation order, for the warm list
+    // By key, from load_compiled. Shared so a builder keeps its blob while
+    // a later load_compiled replaces the entry.
+    std::unordered_map<std::string, std::shared_ptr<const std::vector<uint8_t>>> blobs_;
+    Stats stats_;
+};
+
+// Text form of a memory desc used in cache keys ("any" for format_tag::any).
+std::string md_to_string(const dnnl::memory::desc& md);
+
+#endif // PRIMITIVE_CACHE_HPP
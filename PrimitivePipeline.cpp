@@ -1,32 +1,428 @@
-#include "PrimitivePipeline.hpp"
+
+
+    #include "PrimitivePipeline.hpp"
+#include "BranchExecutor.hpp"
+#include "Logging.hpp"
+#include "Profiler.hpp"
+#include "ThreadPool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
 
 void PrimitivePipeline::insert(const MatMulOperation& op) {
             operations.push_back(op);
         }
+
+static std::string dims_to_string(const dnnl::memory::dims& dims) {
+    std::string out;
+    for (size_t i = 0; i < dims.size(); i++) {
+        out += (i ? "x" : "") + std::to_string(dims[i]);
+    }
+    return out;
+}
+
+void PrimitivePipeline::insert(const CachedPrimitive& p, const std::unordered_map<int, dnnl::memory>& args,
+    const std::string& name) {
+    MatMulOperation op;
+    op.primitive = p.prim;
+    op.args = args;
+    op.name = name;
+    op.spec = p.spec;
+    if (args.count(DNNL_ARG_SRC)) {
+        auto src_dims = args.at(DNNL_ARG_SRC).get_desc().get_dims();
+        op.shape = dims_to_string(src_dims);
+        if (args.count(DNNL_ARG_WEIGHTS)) {
+            op.shape += " * " + dims_to_string(args.at(DNNL_ARG_WEIGHTS).get_desc().get_dims());
+        }
+        if (p.prim.get_kind() == dnnl::primitive::kind::matmul && args.count(DNNL_ARG_DST)) {
+            op.flops = 2.0 * src_dims.back();
+            for (auto d : args.at(DNNL_ARG_DST).get_desc().get_dims()) op.flops *= d;
+        }
+    }
+    auto md = p.pd.scratchpad_desc();
+    if (scratchpad && md.get_size() > 0) {
+        op.scratchpad_md = md;
+        scratchpad->reserve(md);
+    }
+    operations.push_back(op);
+}
     
 void PrimitivePipeline::execute(dnnl::engine& eng, dnnl::stream& strm) {
+    if (scratchpad && !scratchpad_bound) bind_scratchpad(eng);
+    ThreadPool::Scope pool_scope(thread_pool.get());
+    if (profiler) {
+        execute_profiled(strm);
+        return;
+    }
+    if (branches) {
+        execute_concurrent(strm);
+        return;
+    }
     for (auto& op : operations) {
         if (std::holds_alternative<dnnl::primitive>(op.primitive)) {
             std::get<dnnl::primitive>(op.primitive).execute(strm, op.args);
-        } else if (std::holds_alternative<std::function<void()>>(op.primitive)) {
-            std::get<std::function<void()>>(op.primitive)();
+        } else {
+            // Custom ops run on the host and read what earlier primitives wrote
+            strm.wait();
+            std::get<CustomOp>(op.primitive).execute(strm, op.args);
         }
     }
 }
     
-void PrimitivePipeline::insert_custom(const std::function<void()>& custom_func) {
-            operations.push_back({custom_func, {}});
-        }
-        
-        // void PrimitivePipeline::execute(dnnl::engine& eng, dnnl::stream& strm) {
-        //     for (auto& op : operations) {
-        //         if (std::holds_alternative<dnnl::primitive>(op.operation)) {
-        //             std::get<dnnl::primitive>(op.operation).execute(strm, op.args);
-        //         } else if (std::holds_alternative<std::function<void()>>(op.operation)) {
-        //             std::get<std::function<void()>>(op.operation)();
-        //         }
-        //     }
-        // }
-        
-        
-        
\ No newline at end of file
+void PrimitivePipeline::execute_concurrent(dnnl::stream& strm) {
+    for (size_t s = 0; s < stages.size(); s++) {
+        const auto& stage = stages[s];
+        if (stage.size() == 1) {
+            auto& op = operations[stage[0]];
+            if (std::holds_alternative<dnnl::primitive>(op.primitive)) {
+                std::get<dnnl::primitive>(op.primitive).execute(strm, op.args);
+            } else {
+                strm.wait();
+                std::get<CustomOp>(op.primitive).execute(strm, op.args);
+            }
+            continue;
+        }
+
+        // Stages wider than one only hold primitives (custom ops are barriers)
+        strm.wait();
+        branches->run(stage_plans[s], [&](int b, int worker) {
+            auto& op = operations[stage[b]];
+            std::get<dnnl::primitive>(op.primitive).execute(branches->worker_stream(worker), op.args);
+        });
+    }
+}
+
+void PrimitivePipeline::execute_profiled(dnnl::stream& strm) {
+    strm.wait();
+    for (size_t i = 0; i < operations.size(); i++) {
+        auto& op = operations[i];
+        auto start = OpProfiler::Clock::now();
+        if (std::holds_alternative<dnnl::primitive>(op.primitive)) {
+            std::get<dnnl::primitive>(op.primitive).execute(strm, op.args);
+            strm.wait();
+        } else {
+            std::get<CustomOp>(op.primitive).execute(strm, op.args);
+        }
+        profiler->record(i, start, OpProfiler::Clock::now());
+    }
+}
+
+void PrimitivePipeline::execute_observed(dnnl::engine& eng, dnnl::stream& strm,
+    const std::function<void(const MatMulOperation&)>& observer) {
+    if (scratchpad && !scratchpad_bound) bind_scratchpad(eng);
+    ThreadPool::Scope pool_scope(thread_pool.get());
+    for (auto& op : operations) {
+        strm.wait();
+        observer(op);
+        if (std::holds_alternative<dnnl::primitive>(op.primitive)) {
+            std::get<dnnl::primitive>(op.primitive).execute(strm, op.args);
+        } else {
+            std::get<CustomOp>(op.primitive).execute(strm, op.args);
+        }
+    }
+    strm.wait();
+}
+
+void PrimitivePipeline::enable_profiling(bool enable) {
+    if (!enable) {
+        profiler.reset();
+    } else if (!profiler) {
+        profiler = std::make_shared<OpProfiler>();
+    }
+}
+    
+void PrimitivePipeline::insert_custom(const CustomOp& custom_op,
+    const std::unordered_map<int, dnnl::memory>& args, const std::string& name) {
+            MatMulOperation op;
+            op.primitive = custom_op;
+            op.args = args;
+            op.name = name;
+            operations.push_back(op);
+        }
+
+void PrimitivePipeline::append(const PrimitivePipeline& other) {
+    operations.insert(operations.end(), other.operations.begin(), other.operations.end());
+}
+
+dnnl::memory PrimitivePipeline::tensor(const std::string& name) const {
+    auto it = tensors.find(name);
+    if (it == tensors.end()) throw std::invalid_argument("pipeline has no tensor named " + name);
+    return it->second;
+}
+
+void PrimitivePipeline::bind_tensor(const std::string& name, const dnnl::memory& mem,
+    const std::vector<dnnl::memory>& views) {
+    tensors[name] = mem;
+    auto& recorded = tensor_views[name];
+    recorded.clear();
+    auto* base = static_cast<const uint8_t*>(mem.get_data_handle());
+    const size_t size = mem.get_desc().get_size();
+    for (const auto& view : views) {
+        auto* ptr = static_cast<const uint8_t*>(view.get_data_handle());
+        if (ptr < base || ptr + view.get_desc().get_size() > base + size) {
+            throw std::invalid_argument("view is not inside tensor " + name);
+        }
+        recorded.emplace_back(view, ptr - base);
+    }
+}
+
+void PrimitivePipeline::set_tensor_handle(const std::string& name, void* handle) {
+    dnnl::memory base = tensor(name);
+    if (!handle) {
+        auto& own = own_buffers[name];
+        if (!own) {
+            const size_t size = base.get_desc().get_size();
+            own = std::shared_ptr<void>(std::aligned_alloc(64, (size + 63) / 64 * 64), std::free);
+            if (!own) throw std::bad_alloc();
+        }
+        handle = own.get();
+    }
+    // Ops hold copies of these memory objects, which share the handle
+    base.set_data_handle(handle);
+    auto views = tensor_views.find(name);
+    if (views == tensor_views.end()) return;
+    for (auto& [view, offset] : views->second) view.set_data_handle(static_cast<uint8_t*>(handle) + offset);
+}
+
+void PrimitivePipeline::use_shared_scratchpad() {
+    if (!scratchpad) scratchpad = std::make_shared<SharedScratchpad>();
+}
+
+void PrimitivePipeline::bind_scratchpad(dnnl::engine& eng) {
+    if (scratchpad->size > 0) {
+        size_t size = scratchpad->slot_stride() * scratchpad->slots;
+        scratchpad->buffer = std::shared_ptr<void>(std::aligned_alloc(64, size), std::free);
+        if (!scratchpad->buffer) throw std::bad_alloc();
+    }
+    for (size_t i = 0; i < operations.size(); i++) {
+        auto& op = operations[i];
+        if (op.scratchpad_md.get_size() == 0) continue;
+        void* buffer = scratchpad->slot(op_slot.empty() ? 0 : op_slot[i]);
+        op.args[DNNL_ARG_SCRATCHPAD] = dnnl::memory(op.scratchpad_md, eng, buffer);
+    }
+    scratchpad_bound = true;
+    LOG_INFO("Shared scratchpad: %zu bytes x %zu slots\n", scratchpad->size, scratchpad->slots);
+}
+
+static bool is_output_arg(int arg) {
+    return (arg >= DNNL_ARG_DST_0 && arg <= DNNL_ARG_DST_2)
+        || arg == DNNL_ARG_WORKSPACE
+        || (arg >= DNNL_ARG_MULTIPLE_DST && arg < DNNL_ARG_MULTIPLE_DST + 1024);
+}
+
+bool PrimitivePipeline::writes_tensor(const std::string& name) const {
+    if (!has_tensor(name)) return false;
+    const dnnl::memory base = tensor(name);
+    auto* begin = static_cast<const uint8_t*>(base.get_data_handle());
+    const uint8_t* end = begin + base.get_desc().get_size();
+    for (const auto& op : operations) {
+        for (const auto& [arg, mem] : op.args) {
+            if (!is_output_arg(arg) || !mem) continue;
+            auto* ptr = static_cast<const uint8_t*>(mem.get_data_handle());
+            if (ptr < end && begin < ptr + mem.get_desc().get_size()) return true;
+        }
+    }
+    return false;
+}
+
+void PrimitivePipeline::enable_concurrency(dnnl::engine& eng, PrimitiveCache& cache, int max_threads) {
+    branches = std::make_shared<BranchExecutor>(eng, max_threads);
+    build_stages();
+
+    // Plan every wide stage once, by FLOPs, and give each op a primitive
+    // sized for its worker's team
+    std::vector<double> costs;
+    stage_plans.assign(stages.size(), BranchPlan());
+    for (size_t s = 0; s < stages.size(); s++) {
+        if (stages[s].size() < 2) continue;
+        costs.clear();
+        for (int i : stages[s]) costs.push_back(operations[i].flops);
+        branches->plan(costs, stage_plans[s]);
+        const BranchPlan& plan = stage_plans[s];
+        for (size_t w = 0; w < plan.assigned.size(); w++) {
+            for (int b : plan.assigned[w]) partition_op(eng, cache, operations[stages[s][b]], plan.threads[w]);
+        }
+    }
+}
+
+// Swap in op's primitive created for `threads` threads. Ops that did not
+// come from the cache, or whose weights would need another layout, keep
+// their full-width primitive.
+void PrimitivePipeline::partition_op(dnnl::engine& eng, PrimitiveCache& cache, MatMulOperation& op, int threads) {
+    if (op.spec.empty()) {
+        LOG_WARN("%s: not a cached primitive, runs on all threads\n", op.name.c_str());
+        return;
+    }
+    CachedPrimitive cached;
+    try {
+        cached = cache.get_for_threads(eng, op.spec, threads);
+    } catch (const std::exception& e) {
+        LOG_WARN("%s: %s, runs on all threads\n", op.name.c_str(), e.what());
+        return;
+    }
+    auto weights = op.args.find(DNNL_ARG_WEIGHTS);
+    if (weights != op.args.end() && cached.pd.weights_desc() != weights->second.get_desc()) {
+        LOG_WARN("%s: weights layout differs on %d threads, runs on all threads\n", op.name.c_str(), threads);
+        return;
+    }
+    op.primitive = cached.prim;
+    op.spec = cached.spec;
+    if (scratchpad) {
+        auto md = cached.pd.scratchpad_desc();
+        op.scratchpad_md = md.get_size() > 0 ? md : dnnl::memory::desc();
+        scratchpad->reserve(md);
+    }
+}
+
+// Stage of an op = 1 + the latest stage of an earlier op it conflicts with
+// (read after write, write after read or write after write on overlapping
+// bytes). Custom ops may touch state they don't declare, so they conflict
+// with everything.
+void PrimitivePipeline::build_stages() {
+    struct Access {
+        const uint8_t* begin;
+        const uint8_t* end;
+        bool write;
+    };
+    const int n = (int)operations.size();
+    std::vector<std::vector<Access>> access(n);
+    std::vector<bool> barrier(n);
+    for (int i = 0; i < n; i++) {
+        barrier[i] = !std::holds_alternative<dnnl::primitive>(operations[i].primitive);
+        for (const auto& [arg, mem] : operations[i].args) {
+            if (arg == DNNL_ARG_SCRATCHPAD || !mem || !mem.get_data_handle()) continue;
+            auto* ptr = static_cast<const uint8_t*>(mem.get_data_handle());
+            access[i].push_back({ptr, ptr + mem.get_desc().get_size(), is_output_arg(arg)});
+        }
+    }
+    auto conflict = [&](int a, int b) {
+        for (const auto& x : access[a]) {
+            for (const auto& y : access[b]) {
+                if ((x.write || y.write) && x.begin < y.end && y.begin < x.end) return true;
+            }
+        }
+        return false;
+    };
+
+    op_stage.assign(n, 0);
+    op_slot.assign(n, 0);
+    stages.clear();
+    size_t width = 1;
+    for (int i = 0; i < n; i++) {
+        int stage = 0;
+        for (int j = i - 1; j >= 0; j--) {
+            if (op_stage[j] + 1 <= stage) continue;
+            if (barrier[i] || barrier[j] || conflict(i, j)) stage = op_stage[j] + 1;
+            if (barrier[j]) break;  // nothing before a barrier can be later
+        }
+        if (stage == (int)stages.size()) stages.emplace_back();
+        op_stage[i] = stage;
+        op_slot[i] = (int)stages[stage].size();
+        stages[stage].push_back(i);
+        width = std::max(width, stages[stage].size());
+    }
+    if (scratchpad) scratchpad->reserve_slots(width);
+    LOG_INFO("Concurrent schedule: %d ops in %zu stages, widest %zu\n", n, stages.size(), width);
+}
+
+static size_t align_up(size_t v, size_t a) {
+    return (v + a - 1) / a * a;
+}
+
+MemoryPlanStats PrimitivePipeline::plan_activations(const std::vector<dnnl::memory>& activations) {
+    constexpr size_t alignment = 64;
+    struct Tensor {
+        dnnl::memory mem;
+        uint8_t* old_ptr;
+        size_t size;
+        int first = -1, last = -1;
+        size_t offset = 0;
+    };
+    std::vector<Tensor> tensors;
+    for (const auto& mem : activations) {
+        tensors.push_back({mem, static_cast<uint8_t*>(mem.get_data_handle()), mem.get_desc().get_size()});
+    }
+
+    // Map a memory object to the activation it lives in (itself or a view)
+    auto find_base = [&](const dnnl::memory& mem) -> int {
+        auto* ptr = static_cast<uint8_t*>(mem.get_data_handle());
+        for (size_t t = 0; t < tensors.size(); t++) {
+            if (ptr >= tensors[t].old_ptr && ptr < tensors[t].old_ptr + tensors[t].size) return (int)t;
+        }
+        return -1;
+    };
+
+    // Lifetimes: first to last op touching the tensor. A tensor whose first
+    // use is a read carries data in from outside the run, so it lives from op 0.
+    std::vector<std::pair<dnnl::memory, int>> bound;  // every arg memory inside an activation
+    for (int i = 0; i < (int)operations.size(); i++) {
+        for (const auto& [arg, mem] : operations[i].args) {
+            if (!mem || !mem.get_data_handle()) continue;
+            int t = find_base(mem);
+            if (t < 0) continue;
+            // Ops of one stage may run together, so time is the stage there
+            const int time = op_stage.empty() ? i : op_stage[i];
+            if (tensors[t].first < 0) tensors[t].first = is_output_arg(arg) ? time : 0;
+            tensors[t].first = std::min(tensors[t].first, time);
+            tensors[t].last = std::max(tensors[t].last, time);
+            bound.emplace_back(mem, t);
+        }
+    }
+
+    // Greedy interval packing: biggest tensors first, each at the lowest
+    // offset that does not overlap a placed tensor with an overlapping lifetime
+    std::vector<int> order;
+    for (int t = 0; t < (int)tensors.size(); t++) {
+        if (tensors[t].first >= 0) order.push_back(t);
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return tensors[a].size > tensors[b].size;
+    });
+
+    MemoryPlanStats stats;
+    std::vector<int> placed;
+    for (int t : order) {
+        Tensor& cur = tensors[t];
+        std::vector<std::pair<size_t, size_t>> busy;  // [begin, end) in the arena
+        for (int p : placed) {
+            const Tensor& other = tensors[p];
+            if (other.first <= cur.last && cur.first <= other.last) {
+                busy.emplace_back(other.offset, other.offset + align_up(other.size, alignment));
+            }
+        }
+        std::sort(busy.begin(), busy.end());
+        size_t offset = 0;
+        for (const auto& [begin, end] : busy) {
+            if (offset + cur.size <= begin) break;
+            offset = std::max(offset, end);
+        }
+        cur.offset = offset;
+        placed.push_back(t);
+
+        stats.tensors++;
+        stats.unpacked_bytes += align_up(cur.size, alignment);
+        stats.arena_bytes = std::max(stats.arena_bytes, offset + align_up(cur.size, alignment));
+    }
+
+    if (stats.arena_bytes == 0) return stats;
+    arena = std::shared_ptr<void>(std::aligned_alloc(alignment, stats.arena_bytes), std::free);
+    if (!arena) throw std::bad_alloc();
+    auto* base = static_cast<uint8_t*>(arena.get());
+
+    // Rebind views first (they still need the old base pointers), then bases.
+    // Setting a new handle releases the buffer oneDNN allocated for the tensor.
+    for (auto& [mem, t] : bound) {
+        auto* ptr = static_cast<uint8_t*>(mem.get_data_handle());
+        if (ptr < tensors[t].old_ptr || ptr >= tensors[t].old_ptr + tensors[t].size) continue;  // already rebound
+        mem.set_data_handle(base + tensors[t].offset + (ptr - tensors[t].old_ptr));
+    }
+    for (int t : placed) {
+        tensors[t].mem.set_data_handle(base + tensors[t].offset);
+    }
+
+    LOG_INFO("Planned %zu activations: %zu bytes before packing, %zu bytes after\n",
+        stats.tensors, stats.unpacked_bytes, stats.arena_bytes);
+    return stats;
+}
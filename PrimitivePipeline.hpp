@@ -2,31 +2,184 @@
 #define PRIMITIVE_PIPELINE_HPP
 
 #include "oneapi/dnnl/dnnl.hpp"
+#include "BranchExecutor.hpp"
+#include "PrimitiveCache.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 #include <unordered_map>
 #include <variant>  
 
+// A host-side op the pipeline runs like a primitive: it gets the stream and
+// its argument map (declared inputs as DNNL_ARG_MULTIPLE_SRC + i, outputs
+// as DNNL_ARG_MULTIPLE_DST + i) and owns its state explicitly. The kernel
+// is a plain function pointer bound at compile time (make_custom_op), so
+// running it is one direct call and never allocates.
+struct CustomOp {
+    using Args = std::unordered_map<int, dnnl::memory>;
+    using Kernel = void (*)(void* state, dnnl::stream& strm, const Args& args);
+
+    Kernel kernel = nullptr;
+    std::shared_ptr<void> state;  // created once at build time
+
+    void execute(dnnl::stream& strm, const Args& args) const { kernel(state.get(), strm, args); }
+    explicit operator bool() const { return kernel != nullptr; }
+};
+
+// Bind `Run` to `state`, e.g. make_custom_op<MoeDispatch, route_moe_tokens>(moe)
+template <typename State, void (*Run)(State&, dnnl::stream&, const CustomOp::Args&)>
+CustomOp make_custom_op(std::shared_ptr<State> state) {
+    CustomOp op;
+    op.kernel = [](void* s, dnnl::stream& strm, const CustomOp::Args& args) {
+        Run(*static_cast<State*>(s), strm, args);
+    };
+    op.state = std::move(state);
+    return op;
+}
+
 // Structure for a matrix multiplication operation (Keep this here)
 struct MatMulOperation {
-    std::variant<dnnl::primitive, std::function<void()>> primitive;
+    std::variant<dnnl::primitive, CustomOp> primitive;
     std::unordered_map<int, dnnl::memory> args;
+    dnnl::memory::desc scratchpad_md;  // non-empty for primitives in user scratchpad mode
+    std::string spec;                  // cache spec of the primitive, empty if not cached
+
+    // Description for profiling and logs
+    std::string name;
+    std::string shape;   // e.g. "1x12x768 * 1x768x2304"
+    double flops = 0.0;  // per execution, matmuls only
+};
+
+class OpProfiler;
+class ThreadPool;
+
+// One scratchpad buffer shared by all primitives of a pipeline. Ops run one
+// after another, so the buffer only needs to be as large as the biggest
+// request. Custom ops that run primitives themselves reserve() their size
+// and read `buffer` at execution time. Ops running concurrently each need
+// their own copy: the buffer holds `slots` of them, see slot().
+struct SharedScratchpad {
+    size_t size = 0;
+    size_t slots = 1;
+    std::shared_ptr<void> buffer;
+
+    void reserve(const dnnl::memory::desc& md) {
+        if (md.get_size() > size) size = md.get_size();
+    }
+    void reserve_slots(size_t n) { slots = std::max(slots, n); }
+    size_t slot_stride() const { return (size + 63) / 64 * 64; }
+    void* slot(size_t i) const { return static_cast<char*>(buffer.get()) + i * slot_stride(); }
+};
+
+// Result of packing activations into one arena
+struct MemoryPlanStats {
+    size_t tensors = 0;
+    size_t unpacked_bytes = 0;  // sum of the planned tensors' sizes
+    size_t arena_bytes = 0;     // peak after packing
 };
 
 // Class to manage a sequence of operations
 class PrimitivePipeline {
 public:
     void insert(const MatMulOperation& op);
+    // Insert a cached primitive; records its scratchpad needs and shape
+    void insert(const CachedPrimitive& p, const std::unordered_map<int, dnnl::memory>& args,
+        const std::string& name = "");
     void execute(dnnl::engine& eng, dnnl::stream& strm);
-    void insert_custom(const std::function<void()>& custom_func);  // Add this!
+    // Custom ops declare the tensors they touch in `args` (inputs as
+    // DNNL_ARG_MULTIPLE_SRC + i, outputs as DNNL_ARG_MULTIPLE_DST + i) so
+    // memory planning can see them; they are passed to the kernel on every
+    // run. The kernel may keep more state than it declares, so scheduling
+    // treats custom ops as barriers.
+    void insert_custom(const CustomOp& custom_op,
+        const std::unordered_map<int, dnnl::memory>& args = {},
+        const std::string& name = "custom");
     void append(const PrimitivePipeline& other);
     MatMulOperation* get_last_operation() {
         return operations.empty() ? nullptr : &operations.back();
     }
+
+    // Run ops that don't depend on each other at the same time. Ops are
+    // grouped into stages from the tensors they read and write (custom ops
+    // are barriers); a stage's ops run on partitions of up to `max_threads`
+    // threads sized by FLOPs (see BranchExecutor). Each stage is planned
+    // here and its primitives are recreated through `cache` for their
+    // partition's thread count. Call after the last insert and before
+    // plan_activations.
+    void enable_concurrency(dnnl::engine& eng, PrimitiveCache& cache, int max_threads = 0);
+    // Op indices per stage, empty unless concurrency is enabled
+    const std::vector<std::vector<int>>& get_stages() const { return stages; }
+
+    // Place `activations` in one shared arena based on their lifetimes in
+    // the op list (in stages when concurrency is enabled). Two tensors share
+    // bytes only if no op range uses both.
+    // Views (memory objects pointing inside an activation) are rebound with
+    // their base. Pipeline inputs/outputs and weights must not be passed.
+    MemoryPlanStats plan_activations(const std::vector<dnnl::memory>& activations);
+
+    // Opt-in per-op timing. While enabled, execute() waits on the stream
+    // after every primitive so each op's time can be measured.
+    void enable_profiling(bool enable = true);
+    const std::shared_ptr<OpProfiler>& get_profiler() const { return profiler; }
+    // Run once, calling `observer` before every op with its inputs ready
+    // (e.g. to record activation ranges for int8 calibration)
+    void execute_observed(dnnl::engine& eng, dnnl::stream& strm,
+        const std::function<void(const MatMulOperation&)>& observer);
+    const std::vector<MatMulOperation>& get_operations() const { return operations; }
+
+    // Named tensors callers read and write directly (model input/output, ...).
+    // `views` are the memory objects over parts of `mem` (e.g. row tiles);
+    // their offsets are recorded here for set_tensor_handle.
+    void bind_tensor(const std::string& name, const dnnl::memory& mem, const std::vector<dnnl::memory>& views = {});
+    dnnl::memory tensor(const std::string& name) const;
+    bool has_tensor(const std::string& name) const { return tensors.count(name) != 0; }
+    // True if some op writes (part of) tensor `name`
+    bool writes_tensor(const std::string& name) const;
+    // Point tensor `name` at `handle` (same size and layout), moving the
+    // views bound with it along; nullptr points it at a buffer the pipeline
+    // owns. For tensors with their own buffer (e.g. "src"). The buffer
+    // oneDNN allocated for the tensor is released on the first call. Only
+    // the first nullptr call allocates.
+    void set_tensor_handle(const std::string& name, void* handle);
+
+    // Scratchpad sharing: primitives must be created with
+    // scratchpad_mode::user. The buffer is allocated on the first execute()
+    // and bound to every op as DNNL_ARG_SCRATCHPAD.
+    void use_shared_scratchpad();
+    const std::shared_ptr<SharedScratchpad>& shared_scratchpad() const { return scratchpad; }
+
+    // Run custom ops on `pool` (it is the current pool during execute, see
+    // parallel_range). Primitives use it when the stream was made with
+    // make_pool_stream on the same pool.
+    void set_thread_pool(std::shared_ptr<ThreadPool> pool) { thread_pool = std::move(pool); }
+    const std::shared_ptr<ThreadPool>& get_thread_pool() const { return thread_pool; }
+
 private:
+    void bind_scratchpad(dnnl::engine& eng);
+    void execute_profiled(dnnl::stream& strm);
+    void execute_concurrent(dnnl::stream& strm);
+    void build_stages();
+    void partition_op(dnnl::engine& eng, PrimitiveCache& cache, MatMulOperation& op, int threads);
+
     std::vector<MatMulOperation> operations;
+    std::unordered_map<std::string, dnnl::memory> tensors;
+    // Views of bound tensors with their byte offsets, see bind_tensor
+    std::unordered_map<std::string, std::vector<std::pair<dnnl::memory, size_t>>> tensor_views;
+    std::shared_ptr<void> arena;
+    std::unordered_map<std::string, std::shared_ptr<void>> own_buffers;  // see set_tensor_handle
+    std::shared_ptr<SharedScratchpad> scratchpad;
+    std::shared_ptr<OpProfiler> profiler;
+    std::shared_ptr<ThreadPool> thread_pool;
+    bool scratchpad_bound = false;
+
+    std::shared_ptr<BranchExecutor> branches;
+    std::vector<std::vector<int>> stages;
+    std::vector<BranchPlan> stage_plans;  // per stage, empty for single ops
+    std::vector<int> op_stage;  // stage of every op
+    std::vector<int> op_slot;   // position in its stage, picks the scratchpad slot
 };
 
 #endif  // PRIMITIVE_PIPELINE_HPP
-
-
-    
\ No newline at end of file
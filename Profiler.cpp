@@ -0,0 +1,74 @@
+#include "Profiler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+std::string op_kind_name(const MatMulOperation& op) {
+    if (!std::holds_alternative<dnnl::primitive>(op.primitive)) return "custom";
+    switch (std::get<dnnl::primitive>(op.primitive).get_kind()) {
+        case dnnl::primitive::kind::matmul: return "matmul";
+        case dnnl::primitive::kind::softmax: return "softmax";
+        case dnnl::primitive::kind::reorder: return "reorder";
+        case dnnl::primitive::kind::eltwise: return "eltwise";
+        case dnnl::primitive::kind::binary: return "binary";
+        case dnnl::primitive::kind::layer_normalization: return "layer_norm";
+        default: return "primitive";
+    }
+}
+
+OpProfiler::OpProfiler(size_t max_events)
+    : origin(Clock::now()), max_events(max_events) {}
+
+void OpProfiler::record(size_t op, Clock::time_point start, Clock::time_point end) {
+    double start_us = std::chrono::duration<double, std::micro>(start - origin).count();
+    double dur_us = std::chrono::duration<double, std::micro>(end - start).count();
+    if (events.size() < max_events) events.push_back({op, start_us, dur_us});
+
+    if (op >= totals.size()) totals.resize(op + 1);
+    Totals& t = totals[op];
+    t.calls++;
+    t.total_us += dur_us;
+    t.max_us = std::max(t.max_us, dur_us);
+}
+
+void OpProfiler::reset() {
+    origin = Clock::now();
+    events.clear();
+    totals.clear();
+}
+
+void OpProfiler::print_summary(const std::vector<MatMulOperation>& ops) const {
+    double all_us = 0.0;
+    for (const auto& t : totals) all_us += t.total_us;
+
+    printf("%-4s %-16s %-10s %-34s %7s %11s %11s %7s %9s\n",
+        "#", "name", "kind", "shape", "calls", "avg (us)", "max (us)", "%", "GFLOP/s");
+    for (size_t i = 0; i < totals.size() && i < ops.size(); i++) {
+        const Totals& t = totals[i];
+        if (t.calls == 0) continue;
+        double avg_us = t.total_us / t.calls;
+        double gflops = ops[i].flops > 0 ? ops[i].flops / (avg_us * 1e3) : 0.0;
+        printf("%-4zu %-16s %-10s %-34s %7zu %11.2f %11.2f %6.1f%% %9.2f\n",
+            i, ops[i].name.c_str(), op_kind_name(ops[i]).c_str(), ops[i].shape.c_str(),
+            t.calls, avg_us, t.max_us, all_us > 0 ? 100.0 * t.total_us / all_us : 0.0, gflops);
+    }
+    printf("total: %.2f us\n", all_us);
+}
+
+void OpProfiler::write_chrome_trace(const std::string& path, const std::vector<MatMulOperation>& ops) const {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("cannot open trace file: " + path);
+
+    out << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event& e = events[i];
+        const MatMulOperation& op = ops.at(e.op);
+        double gflops = op.flops > 0 && e.dur_us > 0 ? op.flops / (e.dur_us * 1e3) : 0.0;
+        out << (i ? ",\n" : "")
+            << "{\"name\":\"" << op.name << "\",\"cat\":\"" << op_kind_name(op)
+            << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":" << e.start_us << ",\"dur\":" << e.dur_us
+            << ",\"args\":{\"op\":" << e.op << ",\"shape\":\"" << op.shape << "\",\"gflops\":" << gflops << "}}";
+    }
+    out << "\n]}\n";
+}
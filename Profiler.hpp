@@ -0,0 +1,48 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include "PrimitivePipeline.hpp"
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Per-op wall-clock profiler for PrimitivePipeline. The pipeline records one
+// event per op per execute() while profiling is enabled; primitives are
+// timed up to strm.wait(), custom ops directly.
+class OpProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // At most max_events are kept for the trace; totals are always updated
+    explicit OpProfiler(size_t max_events = 100000);
+
+    void record(size_t op, Clock::time_point start, Clock::time_point end);
+    void reset();
+
+    // Table of calls, average/total time, share of the run and GFLOP/s
+    void print_summary(const std::vector<MatMulOperation>& ops) const;
+    // Chrome trace (chrome://tracing, Perfetto) of every recorded event
+    void write_chrome_trace(const std::string& path, const std::vector<MatMulOperation>& ops) const;
+
+private:
+    struct Event {
+        size_t op;
+        double start_us;
+        double dur_us;
+    };
+    struct Totals {
+        size_t calls = 0;
+        double total_us = 0.0;
+        double max_us = 0.0;
+    };
+
+    Clock::time_point origin;
+    size_t max_events;
+    std::vector<Event> events;
+    std::vector<Totals> totals;
+};
+
+// Short name of an op's kind: "matmul", "softmax", ..., or "custom"
+std::string op_kind_name(const MatMulOperation& op);
+
+#endif // PROFILER_HPP
@@ -0,0 +1,101 @@
+#include "Quantization.hpp"
+#include "tensor_utils.h"
+#include "example_utils.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace dnnl;
+
+// Plain row-major tag for a tensor with `ndims` dimensions
+static memory::format_tag plain_tag(size_t ndims) {
+    switch (ndims) {
+        case 1: return memory::format_tag::a;
+        case 2: return memory::format_tag::ab;
+        case 3: return memory::format_tag::abc;
+        default: return memory::format_tag::abcd;
+    }
+}
+
+const char* precision_name(Precision p) {
+    switch (p) {
+        case Precision::f32: return "f32";
+        case Precision::bf16: return "bf16";
+        case Precision::int8: return "int8";
+    }
+    return "unknown";
+}
+
+memory::data_type weight_data_type(Precision p) {
+    switch (p) {
+        case Precision::bf16: return memory::data_type::bf16;
+        case Precision::int8: return memory::data_type::s8;
+        default: return memory::data_type::f32;
+    }
+}
+
+memory::data_type input_data_type(Precision p) {
+    switch (p) {
+        case Precision::bf16: return memory::data_type::bf16;
+        case Precision::int8: return memory::data_type::u8;
+        default: return memory::data_type::f32;
+    }
+}
+
+QuantParams u8_params_from_range(float min, float max) {
+    min = std::min(min, 0.0f);
+    max = std::max(max, 0.0f);
+    QuantParams q;
+    q.scale = max > min ? (max - min) / 255.0f : 1.0f;
+    q.zero_point = static_cast<int32_t>(std::nearbyint(-min / q.scale));
+    return q;
+}
+
+void update_range(const memory& mem, std::pair<float, float>& range) {
+    const float* data = static_cast<const float*>(mem.get_data_handle());
+    const size_t n = mem.get_desc().get_size() / sizeof(float);
+    for (size_t i = 0; i < n; i++) {
+        range.first = std::min(range.first, data[i]);
+        range.second = std::max(range.second, data[i]);
+    }
+}
+
+memory quantize_weights_s8(const memory& weights, engine& eng, memory& scales) {
+    auto dims = weights.get_desc().get_dims();
+    auto plain_md = memory::desc(dims, memory::data_type::f32, plain_tag(dims.size()));
+    memory plain = reorder_memory(weights, plain_md, eng);
+
+    const memory::dim N = dims.back();
+    const memory::dim rows = product(dims) / N;
+    const float* w = static_cast<const float*>(plain.get_data_handle());
+
+    scales = memory(memory::desc({N}, memory::data_type::f32, memory::format_tag::a), eng);
+    float* s = static_cast<float*>(scales.get_data_handle());
+    for (memory::dim n = 0; n < N; n++) {
+        float max_abs = 0.0f;
+        for (memory::dim r = 0; r < rows; r++) max_abs = std::max(max_abs, std::fabs(w[r * N + n]));
+        s[n] = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+    }
+
+    memory q(memory::desc(dims, memory::data_type::s8, plain_tag(dims.size())), eng);
+    int8_t* qw = static_cast<int8_t*>(q.get_data_handle());
+    for (memory::dim r = 0; r < rows; r++) {
+        for (memory::dim n = 0; n < N; n++) {
+            float v = std::nearbyint(w[r * N + n] / s[n]);
+            qw[r * N + n] = static_cast<int8_t>(std::max(-127.0f, std::min(127.0f, v)));
+        }
+    }
+    return q;
+}
+
+memory make_scale(float value, engine& eng) {
+    memory mem(memory::desc({1}, memory::data_type::f32, memory::format_tag::a), eng);
+    *static_cast<float*>(mem.get_data_handle()) = value;
+    return mem;
+}
+
+memory make_zero_point(int32_t value, engine& eng) {
+    memory mem(memory::desc({1}, memory::data_type::s32, memory::format_tag::a), eng);
+    *static_cast<int32_t*>(mem.get_data_handle()) = value;
+    return mem;
+}
@@ -0,0 +1,55 @@
+#ifndef QUANTIZATION_HPP
+#define QUANTIZATION_HPP
+
+#include "oneapi/dnnl/dnnl.hpp"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+// Precision of the weight matmuls. Activations between ops stay f32; only
+// the src of a weight matmul is converted (bf16) or quantized (int8, u8 with
+// a per-tensor scale and zero point) right before it. int8 weights are s8
+// with per-output-channel scales.
+enum class Precision { f32, bf16, int8 };
+
+const char* precision_name(Precision p);
+dnnl::memory::data_type weight_data_type(Precision p);
+dnnl::memory::data_type input_data_type(Precision p);
+
+// Quantization of one tensor: real = scale * (q - zero_point)
+struct QuantParams {
+    float scale = 1.0f;
+    int32_t zero_point = 0;
+};
+
+// Asymmetric u8 parameters covering [min, max] (widened to include 0)
+QuantParams u8_params_from_range(float min, float max);
+
+// Input range of each quantized op, keyed by op name, from calibration
+using Calibration = std::map<std::string, std::pair<float, float>>;
+
+// Widen `range` to cover the values of an f32 tensor
+void update_range(const dnnl::memory& mem, std::pair<float, float>& range);
+
+// Symmetric s8 quantization with one scale per output channel (last dim).
+// Returns plain s8 weights; `scales` receives an f32 [N] tensor.
+dnnl::memory quantize_weights_s8(const dnnl::memory& weights, dnnl::engine& eng, dnnl::memory& scales);
+
+// Single-value tensors for DNNL_ARG_ATTR_SCALES / DNNL_ARG_ATTR_ZERO_POINTS
+dnnl::memory make_scale(float value, dnnl::engine& eng);
+dnnl::memory make_zero_point(int32_t value, dnnl::engine& eng);
+
+inline uint16_t float_to_bf16(float f) {
+    uint32_t bits;
+    __builtin_memcpy(&bits, &f, sizeof(bits));
+    bits += 0x7fff + ((bits >> 16) & 1);  // round to nearest even
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+inline uint8_t quantize_u8(float x, const QuantParams& q) {
+    float v = __builtin_nearbyintf(x / q.scale) + q.zero_point;
+    return static_cast<uint8_t>(v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v));
+}
+
+#endif // QUANTIZATION_HPP
@@ -0,0 +1,124 @@
+#include "RequestBatcher.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+using namespace dnnl;
+
+RequestBatcher::RequestBatcher(BucketedModel& model, engine& eng, int max_batch,
+    std::chrono::microseconds max_wait)
+    : model(model), strm(eng), max_batch(max_batch), max_wait(max_wait),
+      hidden(model.get_config().hidden) {
+    bool fits = false;
+    for (const auto& bucket : model.get_buckets()) fits |= bucket.batch >= max_batch;
+    if (!fits) throw std::invalid_argument("max_batch is larger than the model's largest bucket");
+    stats.batch_size_histogram.assign(max_batch + 1, 0);
+    worker = std::thread(&RequestBatcher::run, this);
+}
+
+RequestBatcher::~RequestBatcher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+std::future<std::vector<float>> RequestBatcher::submit(std::vector<float> input, int seq_len) {
+    if (input.size() != (size_t)seq_len * hidden) {
+        throw std::invalid_argument("request input must be [seq_len, hidden]");
+    }
+    Request request{std::move(input), seq_len, Clock::now(), {}};
+    auto future = request.result.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(request));
+        stats.queue_depth = queue.size();
+    }
+    cv.notify_one();
+    return future;
+}
+
+void RequestBatcher::run() {
+    std::vector<Request> batch;
+    batch.reserve(max_batch);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [&] { return stopping || !queue.empty(); });
+        if (queue.empty()) return;  // stopping and drained
+
+        // Wait for a full batch of the head request's length, or its deadline
+        const int seq_len = queue.front().seq_len;
+        auto deadline = queue.front().arrival + max_wait;
+        auto same_length = [&] {
+            return std::count_if(queue.begin(), queue.end(),
+                [&](const Request& r) { return r.seq_len == seq_len; });
+        };
+        cv.wait_until(lock, deadline, [&] { return stopping || same_length() >= max_batch; });
+
+        auto now = Clock::now();
+        for (auto it = queue.begin(); it != queue.end() && (int)batch.size() < max_batch;) {
+            if (it->seq_len != seq_len) {
+                ++it;
+                continue;
+            }
+            double wait_us = std::chrono::duration<double, std::micro>(now - it->arrival).count();
+            stats.total_wait_us += wait_us;
+            stats.max_wait_us = std::max(stats.max_wait_us, wait_us);
+            batch.push_back(std::move(*it));
+            it = queue.erase(it);
+        }
+        stats.queue_depth = queue.size();
+        stats.requests += batch.size();
+        stats.batches++;
+        stats.batch_size_histogram[batch.size()]++;
+
+        lock.unlock();
+        execute_batch(batch);
+        batch.clear();
+        lock.lock();
+    }
+}
+
+void RequestBatcher::execute_batch(std::vector<Request>& batch) {
+    const int n = (int)batch.size();
+    const int seq_len = batch.front().seq_len;
+    const size_t request_size = (size_t)seq_len * hidden;
+
+    staging_in.resize(n * request_size);
+    staging_out.resize(n * request_size);
+    for (int i = 0; i < n; i++) {
+        std::memcpy(staging_in.data() + i * request_size, batch[i].input.data(), sizeof(float) * request_size);
+    }
+
+    try {
+        model.execute(strm, staging_in.data(), staging_out.data(), n, seq_len);
+    } catch (...) {
+        for (auto& request : batch) request.result.set_exception(std::current_exception());
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        const float* out = staging_out.data() + i * request_size;
+        batch[i].result.set_value(std::vector<float>(out, out + request_size));
+    }
+}
+
+RequestBatcher::Metrics RequestBatcher::metrics() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void RequestBatcher::print_metrics() const {
+    Metrics m = metrics();
+    printf("[BATCHER] requests=%zu batches=%zu queue_depth=%zu avg_wait=%.1f us max_wait=%.1f us\n",
+        m.requests, m.batches, m.queue_depth, m.avg_wait_us(), m.max_wait_us);
+    printf("[BATCHER] batch size histogram:");
+    for (size_t size = 1; size < m.batch_size_histogram.size(); size++) {
+        if (m.batch_size_histogram[size]) printf(" %zu:%zu", size, m.batch_size_histogram[size]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,69 @@
+#ifndef REQUEST_BATCHER_HPP
+#define REQUEST_BATCHER_HPP
+
+#include "BucketedModel.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Dynamic batcher in front of a BucketedModel. Single-sequence requests are
+// queued and a worker thread packs them into the batch dimension of src,
+// runs the model once and hands each caller its slice of the output.
+// A batch is started when max_batch requests of the same length are
+// waiting or the oldest request has waited max_wait.
+class RequestBatcher {
+public:
+    struct Metrics {
+        size_t queue_depth = 0;
+        size_t requests = 0;
+        size_t batches = 0;
+        std::vector<size_t> batch_size_histogram;  // [size] -> number of batches
+        double total_wait_us = 0.0;                // submission to batch start
+        double max_wait_us = 0.0;
+        double avg_wait_us() const { return requests ? total_wait_us / requests : 0.0; }
+    };
+
+    RequestBatcher(BucketedModel& model, dnnl::engine& eng, int max_batch,
+        std::chrono::microseconds max_wait);
+    ~RequestBatcher();
+
+    // input is [seq_len, hidden]; the future gets the [seq_len, hidden] output
+    std::future<std::vector<float>> submit(std::vector<float> input, int seq_len);
+
+    Metrics metrics() const;
+    void print_metrics() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+    struct Request {
+        std::vector<float> input;
+        int seq_len;
+        Clock::time_point arrival;
+        std::promise<std::vector<float>> result;
+    };
+
+    void run();
+    void execute_batch(std::vector<Request>& batch);
+
+    BucketedModel& model;
+    dnnl::stream strm;
+    const int max_batch;
+    const std::chrono::microseconds max_wait;
+    const size_t hidden;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Request> queue;
+    bool stopping = false;
+    Metrics stats;
+
+    std::vector<float> staging_in, staging_out;
+    std::thread worker;
+};
+
+#endif // REQUEST_BATCHER_HPP
@@ -0,0 +1,140 @@
+#include "StreamingPipeline.hpp"
+#include "Logging.hpp"
+#include "example_utils.hpp"
+#include <cstring>
+#include <stdexcept>
+
+using namespace dnnl;
+
+StreamingPipeline::StreamingPipeline(PrimitivePipeline& pipeline, engine& eng, stream& strm, int depth,
+    const std::string& input, const std::string& output)
+    : pipeline(pipeline), eng(eng), strm(strm), input_name(input), output_name(output) {
+    if (depth < 1) throw std::invalid_argument("streaming needs at least one buffer set");
+    if (output_name.empty()) output_name = pipeline.writes_tensor("moe_out") ? "moe_out" : "block_out";
+    if (!pipeline.writes_tensor(output_name)) {
+        throw std::invalid_argument("pipeline never writes streamed output " + output_name);
+    }
+    input_mem = pipeline.tensor(input_name);
+    output_mem = pipeline.tensor(output_name);
+    for (const memory& mem : {input_mem, output_mem}) {
+        const auto md = mem.get_desc();
+        if (md.get_data_type() != memory::data_type::f32 || md.get_size() != product(md.get_dims()) * sizeof(float)) {
+            throw std::invalid_argument("streamed tensors must be dense f32");
+        }
+    }
+    input_bytes = input_mem.get_desc().get_size();
+    output_bytes = output_mem.get_desc().get_size();
+    // Without MoE the last block writes its output back into the input
+    // ("block_out" is "src"): the result stays in the input buffer
+    in_place = output_mem.get_data_handle() == input_mem.get_data_handle();
+    if (in_place && output_bytes != input_bytes) {
+        throw std::invalid_argument("streamed output overlaps the input");
+    }
+
+    slots.resize(depth);
+    for (auto& slot : slots) {
+        slot.input_buffer = memory(input_mem.get_desc(), eng);
+        if (!in_place) slot.output_buffer = memory(output_mem.get_desc(), eng);
+    }
+    worker = std::thread(&StreamingPipeline::run, this);
+    LOG_INFO("Streaming: %d buffer sets of %zu + %zu bytes\n", depth, input_bytes, output_bytes);
+}
+
+StreamingPipeline::~StreamingPipeline() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+    // Swapping buffers in released the pipeline's original ones; give it
+    // buffers of its own again
+    pipeline.set_tensor_handle(input_name, nullptr);
+    if (!in_place) pipeline.set_tensor_handle(output_name, nullptr);
+}
+
+size_t StreamingPipeline::in_flight() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return submitted - drained;
+}
+
+// The next buffer set in submission order, once its last batch is drained
+StreamingPipeline::Slot& StreamingPipeline::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return submitted - drained < slots.size(); });
+    return slots[submitted % slots.size()];
+}
+
+uint64_t StreamingPipeline::submit(const float* input) {
+    Slot& slot = acquire();
+    // Staged outside the lock: this is the copy that overlaps compute
+    std::memcpy(slot.input_buffer.get_data_handle(), input, input_bytes);
+    std::lock_guard<std::mutex> lock(mutex);
+    slot.input = slot.input_buffer.get_data_handle();
+    slot.output = in_place ? slot.input : slot.output_buffer.get_data_handle();
+    slot.result = nullptr;
+    slot.state = State::staged;
+    cv.notify_all();
+    return submitted++;
+}
+
+uint64_t StreamingPipeline::submit_user(float* input, float* output) {
+    Slot& slot = acquire();
+    std::lock_guard<std::mutex> lock(mutex);
+    slot.input = input;
+    slot.output = in_place ? input : output;
+    slot.result = output;
+    slot.state = State::staged;
+    cv.notify_all();
+    return submitted++;
+}
+
+uint64_t StreamingPipeline::drain(float* output) {
+    Slot* slot;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (drained == submitted) throw std::logic_error("no batch to drain");
+        slot = &slots[drained % slots.size()];
+        cv.wait(lock, [&] { return slot->state == State::done; });
+    }
+    std::exception_ptr error = slot->error;
+    // A user-buffer batch already wrote its output in place, unless the
+    // output is the input tensor
+    if (!output) output = static_cast<float*>(slot->result);
+    if (!error && output && output != slot->output) {
+        std::memcpy(output, slot->output, output_bytes);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    slot->state = State::free;
+    slot->error = nullptr;
+    cv.notify_all();
+    const uint64_t batch = drained++;
+    if (error) std::rethrow_exception(error);
+    return batch;
+}
+
+void StreamingPipeline::run() {
+    while (true) {
+        Slot* slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return stopping || computed < submitted; });
+            if (computed == submitted) return;  // stopping with nothing queued
+            slot = &slots[computed % slots.size()];
+            slot->state = State::running;
+        }
+        try {
+            pipeline.set_tensor_handle(input_name, slot->input);
+            if (!in_place) pipeline.set_tensor_handle(output_name, slot->output);
+            pipeline.execute(eng, strm);
+            strm.wait();
+        } catch (...) {
+            slot->error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        slot->state = State::done;
+        computed++;
+        cv.notify_all();
+    }
+}
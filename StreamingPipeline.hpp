@@ -0,0 +1,86 @@
+#ifndef STREAMING_PIPELINE_HPP
+#define STREAMING_PIPELINE_HPP
+
+#include "oneapi/dnnl/dnnl.hpp"
+#include "PrimitivePipeline.hpp"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Streaming execution of one pipeline over `depth` input/output buffer
+// sets. A compute thread runs the batches in submission order; while it
+// runs batch i, the caller stages batch i+1 (submit) and drains batch i-1
+// (drain), so host copies overlap compute. Buffers are swapped in with
+// memory::set_data_handle: nothing is rebuilt and no copy is made between
+// a buffer set and the pipeline (see PrimitivePipeline::set_tensor_handle).
+//
+// The pipeline's input and output must be plain f32 tensors with their own
+// buffers (as "src" and "moe_out" of build_model_pipeline are). An empty
+// output name picks "moe_out" when the model has MoE layers and
+// "block_out" otherwise; an output no op writes is rejected. The input is
+// also the residual stream of the model, so a batch overwrites its input
+// buffer (and holds the result when the output is the input tensor). The
+// pipeline must not be run elsewhere while streaming; afterwards its input
+// and output have fresh (uninitialized) buffers. One thread submits and
+// one (possibly another) drains.
+class StreamingPipeline {
+public:
+    StreamingPipeline(PrimitivePipeline& pipeline, dnnl::engine& eng, dnnl::stream& strm, int depth = 2,
+        const std::string& input = "src", const std::string& output = "");
+    ~StreamingPipeline();
+    StreamingPipeline(const StreamingPipeline&) = delete;
+    StreamingPipeline& operator=(const StreamingPipeline&) = delete;
+
+    // Copy `input` into the next free buffer set and queue the batch.
+    // Blocks while all `depth` sets are in flight. Returns the batch number.
+    uint64_t submit(const float* input);
+    // Queue a batch on the caller's buffers (user handles, no copy). Both
+    // must stay valid until the batch is drained; `input` is overwritten.
+    uint64_t submit_user(float* input, float* output);
+
+    // Wait for the oldest undrained batch and copy its output to `output`
+    // (may be null for user-buffer batches, whose output is already in
+    // place). Rethrows an exception the batch raised. Returns its number.
+    uint64_t drain(float* output);
+
+    int depth() const { return (int)slots.size(); }
+    size_t input_size() const { return input_bytes / sizeof(float); }
+    size_t output_size() const { return output_bytes / sizeof(float); }
+    size_t in_flight() const;
+
+private:
+    enum class State { free, staged, running, done };
+    struct Slot {
+        State state = State::free;
+        dnnl::memory input_buffer, output_buffer;  // owned buffers
+        void* input = nullptr;                     // handles the batch runs on
+        void* output = nullptr;
+        void* result = nullptr;                    // where the caller wants the output
+        std::exception_ptr error;
+    };
+
+    Slot& acquire();
+    void run();
+
+    PrimitivePipeline& pipeline;
+    dnnl::engine eng;
+    dnnl::stream strm;
+    std::string input_name, output_name;
+    dnnl::memory input_mem, output_mem;
+    size_t input_bytes, output_bytes;
+    bool in_place;  // output is (a view of) the input buffer
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Slot> slots;
+    uint64_t submitted = 0, computed = 0, drained = 0;
+    bool stopping = false;
+    std::thread worker;
+};
+
+#endif // STREAMING_PIPELINE_HPP
@@ -0,0 +1,214 @@
+#include "ThreadPool.hpp"
+#include "Affinity.hpp"
+#include "Logging.hpp"
+#include <algorithm>
+#ifdef MODEL_THREADPOOL
+#include "oneapi/dnnl/dnnl_threadpool.hpp"
+#endif
+
+using namespace dnnl;
+
+namespace {
+
+thread_local ThreadPool* current_pool = nullptr;
+thread_local const ThreadPool* running_pool = nullptr;  // set inside tasks
+
+// Spins before a worker sleeps; long enough to catch back-to-back ops
+const int spin_iterations = 20000;
+
+} // namespace
+
+#ifdef MODEL_THREADPOOL
+// oneDNN's view of a ThreadPool. Synchronous: parallel_for returns when done.
+class DnnlThreadpool : public threadpool_interop::threadpool_iface {
+public:
+    explicit DnnlThreadpool(ThreadPool& pool) : pool(pool) {}
+    int get_num_threads() const override { return pool.num_threads(); }
+    bool get_in_parallel() const override { return pool.in_parallel(); }
+    uint64_t get_flags() const override { return 0; }
+    void parallel_for(int n, const std::function<void(int, int)>& fn) override { pool.parallel_for(n, fn); }
+
+private:
+    ThreadPool& pool;
+};
+#endif
+
+ThreadPool::ThreadPool(const std::vector<int>& cpus, bool pin) : cpus(cpus) {
+    if (this->cpus.empty()) {
+        for (const auto& group : partition_cores(1)) this->cpus = group.cpus;
+    }
+    for (size_t i = 0; i < this->cpus.size(); i++) ranges.push_back(std::make_unique<Range>());
+    for (int id = 1; id < num_threads(); id++) {
+        workers.emplace_back([this, id, pin]() {
+            if (pin) pin_current_thread({this->cpus[id]});
+            worker_loop(id);
+        });
+    }
+#ifdef MODEL_THREADPOOL
+    adapter = std::make_unique<DnnlThreadpool>(*this);
+#endif
+    LOG_INFO("Thread pool: %d threads%s\n", num_threads(), pin ? ", pinned" : "");
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto& t : workers) t.join();
+}
+
+bool ThreadPool::in_parallel() const {
+    return running_pool == this;
+}
+
+// Next index for participant `id`: from its own range, else stolen
+bool ThreadPool::take(int id, int& index) {
+    {
+        Range& own = *ranges[id];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (own.begin < own.end) {
+            index = own.begin++;
+            return true;
+        }
+    }
+    // Steal the back half of the fullest range; retry if it empties first
+    const int n = (int)ranges.size();
+    int begin = 0, end = 0;
+    while (begin == end) {
+        int victim = -1, most = 0;
+        for (int k = 1; k < n; k++) {
+            int v = (id + k) % n;
+            Range& r = *ranges[v];
+            std::lock_guard<std::mutex> lock(r.mutex);
+            if (r.end - r.begin > most) {
+                most = r.end - r.begin;
+                victim = v;
+            }
+        }
+        if (victim < 0) return false;
+        Range& r = *ranges[victim];
+        std::lock_guard<std::mutex> lock(r.mutex);
+        if (r.begin < r.end) {
+            begin = r.end - std::max(1, (r.end - r.begin) / 2);
+            end = r.end;
+            r.end = begin;
+        }
+    }
+    Range& own = *ranges[id];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    own.begin = begin + 1;
+    own.end = end;
+    index = begin;
+    return true;
+}
+
+void ThreadPool::run_tasks(int id) {
+    const ThreadPool* outer = running_pool;
+    running_pool = this;
+    int index;
+    while (take(id, index)) {
+        (*job)(index, job_size);
+        if (remaining.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            done.notify_all();
+        }
+    }
+    running_pool = outer;
+}
+
+void ThreadPool::worker_loop(int id) {
+    uint64_t seen = 0;
+    while (true) {
+        // Spin for a moment: ops often come back to back
+        for (int i = 0; i < spin_iterations; i++) {
+            if (__atomic_load_n(&generation, __ATOMIC_ACQUIRE) != seen) break;
+            std::this_thread::yield();
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+            // Woke after the job finished: the caller may already be
+            // setting up the next one, so stay out of the ranges
+            if (!job) continue;
+            active++;
+        }
+        run_tasks(id);
+        if (active.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int, int)>& fn) {
+    if (n <= 0) return;
+    if (n == 1 || num_threads() == 1 || in_parallel()) {
+        for (int i = 0; i < n; i++) fn(i, n);
+        return;
+    }
+
+    std::lock_guard<std::mutex> job_lock(job_mutex);
+    const int participants = num_threads();
+    for (int p = 0; p < participants; p++) {
+        std::lock_guard<std::mutex> lock(ranges[p]->mutex);
+        ranges[p]->begin = (int)((int64_t)n * p / participants);
+        ranges[p]->end = (int)((int64_t)n * (p + 1) / participants);
+    }
+    remaining = n;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &fn;
+        job_size = n;
+        __atomic_store_n(&generation, generation + 1, __ATOMIC_RELEASE);
+    }
+    wake.notify_all();
+
+    run_tasks(0);
+
+    // All tasks done and no worker still looking at this job; clearing the
+    // job keeps late wakers out until the next one is published
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return remaining == 0 && active == 0; });
+    job = nullptr;
+}
+
+ThreadPool::Scope::Scope(ThreadPool* pool) : previous(current_pool) {
+    current_pool = pool;
+}
+
+ThreadPool::Scope::~Scope() {
+    current_pool = previous;
+}
+
+ThreadPool* ThreadPool::current() {
+    return current_pool;
+}
+
+void parallel_range(int64_t n, int64_t grain, const std::function<void(int64_t, int64_t)>& fn) {
+    if (n <= 0) return;
+    grain = std::max<int64_t>(1, grain);
+    const int64_t chunks = (n + grain - 1) / grain;
+    if (ThreadPool* pool = ThreadPool::current()) {
+        pool->parallel_for((int)chunks, [&](int c, int) {
+            fn(c * grain, std::min(n, (c + 1) * grain));
+        });
+        return;
+    }
+    #pragma omp parallel for schedule(static) if (chunks > 1)
+    for (int64_t c = 0; c < chunks; c++) {
+        fn(c * grain, std::min(n, (c + 1) * grain));
+    }
+}
+
+stream make_pool_stream(const engine& eng, ThreadPool& pool) {
+#ifdef MODEL_THREADPOOL
+    return threadpool_interop::make_stream(eng, pool.adapter.get());
+#else
+    (void)pool;
+    return stream(eng);
+#endif
+}
@@ -0,0 +1,102 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include "oneapi/dnnl/dnnl.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// oneDNN built with DNNL_CPU_RUNTIME=THREADPOOL runs primitives on a pool
+// the application passes in with the stream (see make_pool_stream)
+#if defined(DNNL_RUNTIME_THREADPOOL) && DNNL_CPU_THREADING_RUNTIME == DNNL_RUNTIME_THREADPOOL
+#define MODEL_THREADPOOL 1
+#endif
+
+#ifdef MODEL_THREADPOOL
+class DnnlThreadpool;
+#endif
+
+// Work-stealing thread pool. parallel_for splits [0, n) evenly over the
+// participants (the caller plus the workers); a participant that runs out
+// steals half of the largest remaining range of another. Idle workers
+// spin briefly, then sleep on a condition variable, so several pools in
+// one process don't burn each other's cores the way OpenMP spin-waits do.
+//
+// A pool can be limited to a core mask and pin one worker per core (the
+// calling thread takes the first core's share and is left unpinned); give
+// pipelines that run side by side disjoint masks. One parallel_for runs at
+// a time; a call from inside a task runs inline.
+class ThreadPool {
+public:
+    // cpus: the core mask; empty = every CPU the process may use
+    explicit ThreadPool(const std::vector<int>& cpus = {}, bool pin = true);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int num_threads() const { return (int)cpus.size(); }
+    const std::vector<int>& get_cpus() const { return cpus; }
+    // The calling thread is running a task of this pool
+    bool in_parallel() const;
+
+    // Call fn(i, n) for every i in [0, n); returns when all are done
+    void parallel_for(int n, const std::function<void(int, int)>& fn);
+
+    // Makes `pool` the calling thread's current pool (see parallel_range)
+    // for the scope's lifetime
+    class Scope {
+    public:
+        explicit Scope(ThreadPool* pool);
+        ~Scope();
+    private:
+        ThreadPool* previous;
+    };
+    static ThreadPool* current();
+
+private:
+    friend dnnl::stream make_pool_stream(const dnnl::engine& eng, ThreadPool& pool);
+
+    struct Range {
+        std::mutex mutex;
+        int begin = 0;
+        int end = 0;
+    };
+
+    void worker_loop(int id);
+    void run_tasks(int id);
+    bool take(int id, int& index);
+
+    std::vector<int> cpus;
+    std::vector<std::unique_ptr<Range>> ranges;  // one per participant, 0 = caller
+    std::vector<std::thread> workers;
+
+    std::mutex job_mutex;  // one parallel_for at a time
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(int, int)>* job = nullptr;
+    int job_size = 0;
+    uint64_t generation = 0;
+    std::atomic<int> remaining{0};
+    std::atomic<int> active{0};  // workers inside run_tasks
+    bool stop = false;
+
+#ifdef MODEL_THREADPOOL
+    std::unique_ptr<DnnlThreadpool> adapter;  // oneDNN's view of this pool
+#endif
+};
+
+// Run fn(begin, end) over chunks of `grain` items of [0, n): on the calling
+// thread's current pool when there is one, otherwise with OpenMP
+void parallel_range(int64_t n, int64_t grain, const std::function<void(int64_t, int64_t)>& fn);
+
+// A stream whose primitives run on `pool`; it must not outlive the pool.
+// With the OpenMP runtime oneDNN keeps its own threads and this is a plain
+// stream; the pool then only serves custom ops.
+dnnl::stream make_pool_stream(const dnnl::engine& eng, ThreadPool& pool);
+
+#endif // THREAD_POOL_HPP
@@ -0,0 +1,232 @@
+// Layer-level and end-to-end throughput benchmark for the model pipelines.
+//
+// Build from the repository root, e.g.:
+//   icpx -O2 -fopenmp -I. -o benchmark benchmarks/benchmark.cpp ModelBuilder.cpp
+//       Affinity.cpp BranchExecutor.cpp KvCache.cpp MoeDispatch.cpp OpGraph.cpp
+//       PrimitiveCache.cpp PrimitivePipeline.cpp Profiler.cpp Quantization.cpp
+//       ThreadPool.cpp tensor_utils.cpp -ldnnl
+//
+// Usage:
+//   ./benchmark [--layers attention,ffn,moe,model] [--batch 1,8] [--seq 16,128]
+//               [--hidden 768] [--threads 1,8] [--blocks 1] [--concurrent 0|1]
+//               [--ffn-act relu|gelu_tanh|gelu_erf|swiglu] [--ffn-tile 0,64]
+//               [--warmup 5] [--iters 50]
+//               [--csv results.csv] [--json results.json]
+//
+// For every combination it reports the cold time (pipeline build incl.
+// primitive creation/JIT, plus the first run) and warm per-iteration
+// latency (p50/p99/mean) after warmup, with tokens/s and GFLOP/s.
+
+#include "ModelBuilder.hpp"
+#include "Logging.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace dnnl;
+using Clock = std::chrono::steady_clock;
+
+struct BenchResult {
+    std::string layer;
+    int batch, seq_len, hidden, threads, blocks;
+    bool concurrent;
+    int ffn_tile;
+    double cold_ms;
+    double p50_us, p99_us, mean_us;
+    double tokens_per_s;
+    double gflops;
+};
+
+static std::vector<int> parse_ints(const std::string& s) {
+    std::vector<int> values;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) values.push_back(std::stoi(item));
+    return values;
+}
+
+static std::vector<std::string> parse_list(const std::string& s) {
+    std::vector<std::string> values;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) values.push_back(item);
+    return values;
+}
+
+static int layer_mask(const std::string& layer) {
+    if (layer == "attention") return layer_attention;
+    if (layer == "ffn") return layer_ffn;
+    if (layer == "moe") return layer_moe;
+    if (layer == "model") return layer_all;
+    throw std::invalid_argument("unknown layer: " + layer);
+}
+
+static FfnActivation ffn_activation(const std::string& name) {
+    if (name == "relu") return FfnActivation::relu;
+    if (name == "gelu_tanh") return FfnActivation::gelu_tanh;
+    if (name == "gelu_erf") return FfnActivation::gelu_erf;
+    if (name == "swiglu") return FfnActivation::swiglu;
+    throw std::invalid_argument("unknown FFN activation: " + name);
+}
+
+static double percentile(std::vector<double> sorted, double p) {
+    size_t idx = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+    return sorted[idx];
+}
+
+static BenchResult run_case(engine& eng, const std::string& layer, int batch, int seq_len, int hidden,
+    int threads, int blocks, bool concurrent, FfnActivation ffn_act, int ffn_tile, int warmup, int iters) {
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    ModelConfig config;
+    config.batch = batch;
+    config.seq_len = seq_len;
+    config.hidden = hidden;
+    config.num_heads = hidden % 64 == 0 ? hidden / 64 : 1;  // head size 64
+    config.ffn_hidden = 4 * hidden;
+    config.layers = layer_mask(layer);
+    config.num_blocks = blocks;
+    config.shared_scratchpad = true;
+    config.concurrent_branches = concurrent;
+    config.ffn_activation = ffn_act;
+    config.ffn_tile_rows = ffn_tile;
+
+    stream strm(eng);
+    auto weights = create_model_weights(eng, config);
+
+    // Cold: a fresh cache, and oneDNN's own primitive cache off, so
+    // primitive creation and JIT are included
+    PrimitiveCache cache;
+    const int library_cache_capacity = get_primitive_cache_capacity();
+    set_primitive_cache_capacity(0);
+    auto cold_start = Clock::now();
+    PrimitivePipeline model = build_model_pipeline(eng, config, weights, cache);
+    model.execute(eng, strm);
+    strm.wait();
+    double cold_ms = std::chrono::duration<double, std::milli>(Clock::now() - cold_start).count();
+    set_primitive_cache_capacity(library_cache_capacity);
+
+    for (int i = 0; i < warmup; i++) model.execute(eng, strm);
+    strm.wait();
+
+    std::vector<double> latencies;
+    latencies.reserve(iters);
+    for (int i = 0; i < iters; i++) {
+        auto start = Clock::now();
+        model.execute(eng, strm);
+        strm.wait();
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    double mean_us = 0.0;
+    for (double l : latencies) mean_us += l;
+    mean_us /= latencies.size();
+
+    // Primitive matmuls, plus the MoE expert matmuls that run inside the
+    // dispatch custom op: top_k [1, H] x [H, H] per token (no capacity
+    // limit, so nothing is dropped)
+    double flops = 0.0;
+    for (const auto& op : model.get_operations()) flops += op.flops;
+    if (config.layers & layer_moe) flops += 2.0 * batch * seq_len * config.top_k * hidden * hidden;
+
+    return {layer, batch, seq_len, hidden, threads, blocks, concurrent, ffn_tile, cold_ms,
+        percentile(latencies, 0.50), percentile(latencies, 0.99), mean_us,
+        (double)batch * seq_len / (mean_us * 1e-6), flops / (mean_us * 1e3)};
+}
+
+static void write_csv(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    out << "layer,batch,seq_len,hidden,threads,blocks,concurrent,ffn_tile,cold_ms,p50_us,p99_us,mean_us,tokens_per_s,gflops\n";
+    for (const auto& r : results) {
+        out << r.layer << "," << r.batch << "," << r.seq_len << "," << r.hidden << "," << r.threads << "," << r.blocks << "," << r.concurrent << "," << r.ffn_tile << ","
+            << r.cold_ms << "," << r.p50_us << "," << r.p99_us << "," << r.mean_us << ","
+            << r.tokens_per_s << "," << r.gflops << "\n";
+    }
+}
+
+static void write_json(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        out << "  {\"layer\": \"" << r.layer << "\", \"batch\": " << r.batch << ", \"seq_len\": " << r.seq_len
+            << ", \"hidden\": " << r.hidden << ", \"threads\": " << r.threads << ", \"blocks\": " << r.blocks
+            << ", \"concurrent\": " << (r.concurrent ? "true" : "false") << ", \"ffn_tile\": " << r.ffn_tile
+            << ", \"cold_ms\": " << r.cold_ms
+            << ", \"p50_us\": " << r.p50_us << ", \"p99_us\": " << r.p99_us << ", \"mean_us\": " << r.mean_us
+            << ", \"tokens_per_s\": " << r.tokens_per_s << ", \"gflops\": " << r.gflops << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> layers = {"attention", "ffn", "moe", "model"};
+    std::vector<int> batches = {1, 8};
+    std::vector<int> seq_lens = {16, 128};
+    std::vector<int> hiddens = {768};
+    std::vector<int> thread_counts = {1};
+#ifdef _OPENMP
+    thread_counts = {omp_get_max_threads()};
+#endif
+    int blocks = 1, warmup = 5, iters = 50;
+    bool concurrent = false;
+    FfnActivation ffn_act = FfnActivation::relu;
+    std::vector<int> ffn_tiles = {0};
+    std::string csv_path = "benchmark.csv", json_path;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i], value = argv[i + 1];
+        if (arg == "--layers") layers = parse_list(value);
+        else if (arg == "--batch") batches = parse_ints(value);
+        else if (arg == "--seq") seq_lens = parse_ints(value);
+        else if (arg == "--hidden") hiddens = parse_ints(value);
+        else if (arg == "--threads") thread_counts = parse_ints(value);
+        else if (arg == "--blocks") blocks = std::stoi(value);
+        else if (arg == "--concurrent") concurrent = std::stoi(value) != 0;
+        else if (arg == "--ffn-act") ffn_act = ffn_activation(value);
+        else if (arg == "--ffn-tile") ffn_tiles = parse_ints(value);
+        else if (arg == "--warmup") warmup = std::stoi(value);
+        else if (arg == "--iters") iters = std::stoi(value);
+        else if (arg == "--csv") csv_path = value;
+        else if (arg == "--json") json_path = value;
+        else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    set_log_level(LogLevel::error);
+    engine eng(engine::kind::cpu, 0);
+
+    std::vector<BenchResult> results;
+    printf("%-10s %5s %5s %6s %7s %8s %10s %10s %10s %12s %9s\n",
+        "layer", "batch", "seq", "hidden", "threads", "ffn tile", "cold (ms)", "p50 (us)", "p99 (us)", "tokens/s", "GFLOP/s");
+    for (const auto& layer : layers)
+        for (int hidden : hiddens)
+            for (int batch : batches)
+                for (int seq_len : seq_lens)
+                    for (int threads : thread_counts)
+                        for (int ffn_tile : ffn_tiles) {
+                            auto r = run_case(eng, layer, batch, seq_len, hidden, threads, blocks, concurrent,
+                                ffn_act, ffn_tile, warmup, iters);
+                            printf("%-10s %5d %5d %6d %7d %8d %10.2f %10.2f %10.2f %12.0f %9.2f\n",
+                                r.layer.c_str(), r.batch, r.seq_len, r.hidden, r.threads, r.ffn_tile,
+                                r.cold_ms, r.p50_us, r.p99_us, r.tokens_per_s, r.gflops);
+                            results.push_back(r);
+                        }
+
+    if (!csv_path.empty()) write_csv(csv_path, results);
+    if (!json_path.empty()) write_json(json_path, results);
+    return 0;
+}
@@ -1,20 +1,157 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
 #include "PrimitivePipeline.hpp"
 #include "oneapi/dnnl/dnnl.hpp"
+#include "Affinity.hpp"
+#include "DecodeModel.hpp"
 #include "ModelBuilder.hpp"
+#include "ModelFile.hpp"
+#include "Profiler.hpp"
+#include "StreamingPipeline.hpp"
+#include "ThreadPool.hpp"
 
 using namespace dnnl;
 
 int main() {
     // Initialize DNNL engine and stream
     engine eng(engine::kind::cpu, 0);
-    stream strm(eng);
+
+    // Primitives and custom ops share one work-stealing pool when oneDNN is
+    // built with the THREADPOOL runtime, or when MODEL_CORES (a CPU list such
+    // as "0-7") restricts the model to a core mask. Otherwise oneDNN and the
+    // custom ops use OpenMP.
+    std::shared_ptr<ThreadPool> pool;
+    const char* cores = std::getenv("MODEL_CORES");
+#ifdef MODEL_THREADPOOL
+    pool = std::make_shared<ThreadPool>(cores ? parse_cpu_list(cores) : std::vector<int>());
+#else
+    if (cores) pool = std::make_shared<ThreadPool>(parse_cpu_list(cores));
+#endif
+    stream strm = pool ? make_pool_stream(eng, *pool) : stream(eng);
 
     // Build and execute model pipeline
     // printf("Memory initialized\n");
-    PrimitivePipeline model = build_model_pipeline(eng);
+    // The compiled cache from a previous run lets the cache create every
+    // primitive (from its cache blob where the engine supports it) before
+    // the model is built. Together with the model file this is the whole
+    // cold start: no weight init, no reorders, no JIT with blobs.
+    auto startup = std::chrono::steady_clock::now();
+    const char* compiled_cache = "primitive_cache.bin";
+    PrimitiveCache::global().load_compiled(eng, compiled_cache);
+
+    ModelConfig config;
+    config.shared_scratchpad = true;
+
+    // Weights come from a model file when there is one (MODEL_FILE, default
+    // model.bin) and it was saved for this config. Otherwise they are
+    // created and, after the build has reordered them, saved so the next
+    // start maps them ready to use.
+    const char* model_file = std::getenv("MODEL_FILE") ? std::getenv("MODEL_FILE") : "model.bin";
+    const uint64_t config_hash = model_config_hash(config);
+    MappedWeights mapped;
+    bool have_file = access(model_file, R_OK) == 0;
+    if (have_file) {
+        std::string stale;
+        try {
+            mapped = load_model_file(eng, model_file);
+            std::string mismatch = find_weight_mismatch(config, mapped.weights);
+            if (mapped.config_hash != config_hash) {
+                stale = "saved for another model config";
+            } else if (!mismatch.empty()) {
+                stale = "wrong or missing " + mismatch;
+            }
+        } catch (const std::runtime_error& e) {
+            stale = e.what();
+        }
+        if (!stale.empty()) {
+            printf("%s: %s, rebuilding it\n", model_file, stale.c_str());
+            mapped = MappedWeights();
+            have_file = false;
+        }
+    }
+    if (!have_file) mapped.weights = create_model_weights(eng, config);
+    PrimitivePipeline model = build_model_pipeline(eng, config, mapped.weights);
+    model.set_thread_pool(pool);
+    if (!have_file) save_model_file(model_file, mapped.weights, config_hash);
+    printf("Startup: %.2f ms\n", std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - startup).count());
+
+    // MODEL_PROFILE=1 times every op and writes a Chrome trace
+    bool profile = std::getenv("MODEL_PROFILE") != nullptr;
+    if (profile) model.enable_profiling();
+
     model.execute(eng, strm);
 
+    if (profile) {
+        model.get_profiler()->print_summary(model.get_operations());
+        model.get_profiler()->write_chrome_trace("profile.json", model.get_operations());
+    }
+
+    // MODEL_REPLICAS=K builds K more pipelines over the same weights, each on
+    // its own share of the cores, and runs them side by side
+    if (const char* replica_count = std::getenv("MODEL_REPLICAS")) {
+        auto replicas = build_model_replicas(eng, config, mapped.weights, std::atoi(replica_count));
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (auto& replica : replicas) {
+            threads.emplace_back([&eng, &replica]() { replica.execute(eng); });
+        }
+        for (auto& t : threads) t.join();
+        printf("%zu replicas: %.2f ms\n", replicas.size(), std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+
+    // MODEL_STREAM=N streams N batches through double-buffered input and
+    // output sets: staging and draining overlap the batch in between
+    if (const char* stream_batches = std::getenv("MODEL_STREAM")) {
+        const int batches = std::atoi(stream_batches);
+        auto start = std::chrono::steady_clock::now();
+        {
+            StreamingPipeline streaming(model, eng, strm);
+            std::vector<float> input(streaming.input_size()), output(streaming.output_size());
+            fill_random_data(input, config.seed);
+            for (int i = 0; i < batches; i++) {
+                if (streaming.in_flight() == (size_t)streaming.depth()) streaming.drain(output.data());
+                streaming.submit(input.data());
+            }
+            while (streaming.in_flight() > 0) streaming.drain(output.data());
+        }
+        printf("%d streamed batches: %.2f ms\n", batches, std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+
+    // MODEL_DECODE=N runs a prompt of config.seq_len tokens through the KV
+    // cache, then decodes N more tokens one at a time
+    if (const char* decode_steps = std::getenv("MODEL_DECODE")) {
+        DecodeModel decoder(eng, config);
+        const int H = config.hidden, prompt_len = config.seq_len;
+        std::vector<float> prompt((size_t)prompt_len * H), token(H), out((size_t)prompt_len * H);
+        fill_random_data(prompt, config.seed);
+        std::vector<uint64_t> keys(prompt_len);
+        for (int i = 0; i < prompt_len; i++) keys[i] = i;
+
+        int seq = decoder.start(keys);
+        decoder.step(strm, seq, prompt.data(), prompt_len, out.data(), keys.data());
+        // Feed each output back in as the next token's embedding
+        std::vector<float> next(out.end() - H, out.end());
+        for (int i = 0; i < std::atoi(decode_steps); i++) {
+            token.swap(next);
+            decoder.step(strm, seq, token.data(), 1, next.data());
+        }
+        decoder.cache().print_stats();
+        decoder.finish(seq);
+    }
+
+    PrimitiveCache::global().print_stats();
+    PrimitiveCache::global().save_compiled(compiled_cache);
+
     std::cout << "Model execution completed successfully." << std::endl;
     return 0;
 }
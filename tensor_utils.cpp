@@ -1,11 +1,12 @@
 #include "tensor_utils.h"
-#include <random>
+#include <cmath>
+#include <stdexcept>
 #include "oneapi/dnnl/dnnl.hpp"
 #include "example_utils.hpp"
 
 // Create memory descriptor
-memory::desc create_memory_desc(const memory::dims& dims, memory::format_tag format) {
-    return memory::desc(dims, memory::data_type::f32, format);
+memory::desc create_memory_desc(const memory::dims& dims, memory::format_tag format, memory::data_type dt) {
+    return memory::desc(dims, dt, format);
 }
 
 // Initialize memory and fill with data
@@ -17,12 +18,119 @@ memory initialize_memory(const memory::desc& md, engine& eng, std::vector<float>
     return mem;
 }
 
-// Fill tensor with random values
-void fill_random_data(std::vector<float>& data) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<float> dist(0.0, 1.0);
-    for (auto& val : data) {
-        val = dist(gen);
+// Create a strided view into an existing tensor
+memory create_view(const memory& base, const memory::desc& md, size_t byte_offset) {
+    auto* handle = static_cast<uint8_t*>(base.get_data_handle()) + byte_offset;
+    return memory(md, base.get_engine(), handle);
+}
+
+// Same dims and data type, layout left to the primitive
+memory::desc any_layout(const memory::desc& md) {
+    return memory::desc(md.get_dims(), md.get_data_type(), memory::format_tag::any);
+}
+
+// Reorder into a new tensor with the requested layout
+memory reorder_memory(const memory& src, const memory::desc& md, engine& eng) {
+    if (src.get_desc() == md) return src;
+    memory dst(md, eng);
+    stream s(eng);
+    reorder(src, dst).execute(s, const_cast<memory&>(src), dst);
+    s.wait();
+    return dst;
+}
+
+namespace {
+
+// Philox4x32-10: four 32-bit outputs per 128-bit counter
+struct Philox4x32 {
+    uint32_t v[4];
+
+    Philox4x32(uint64_t counter, uint64_t stream, uint64_t seed) {
+        uint32_t c[4] = {(uint32_t)counter, (uint32_t)(counter >> 32), (uint32_t)stream, (uint32_t)(stream >> 32)};
+        uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+        for (int round = 0; round < 10; round++) {
+            uint64_t p0 = (uint64_t)0xD2511F53u * c[0];
+            uint64_t p1 = (uint64_t)0xCD9E8D57u * c[2];
+            uint32_t next[4] = {(uint32_t)(p1 >> 32) ^ c[1] ^ k0, (uint32_t)p1,
+                                (uint32_t)(p0 >> 32) ^ c[3] ^ k1, (uint32_t)p0};
+            c[0] = next[0]; c[1] = next[1]; c[2] = next[2]; c[3] = next[3];
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        v[0] = c[0]; v[1] = c[1]; v[2] = c[2]; v[3] = c[3];
+    }
+};
+
+// [0, 1) and (0, 1] from the top 24 bits
+inline float to_unit(uint32_t x) { return (x >> 8) * (1.0f / 16777216.0f); }
+inline float to_unit_open(uint32_t x) { return ((x >> 8) + 1) * (1.0f / 16777216.0f); }
+
+// Element i uses output i % 4 of counter i / 4, so any split of the range
+// over threads produces the same values
+void fill(float* data, size_t n, const InitSpec& spec, float a, float b) {
+    const int64_t groups = (int64_t)((n + 3) / 4);
+    #pragma omp parallel for schedule(static)
+    for (int64_t g = 0; g < groups; g++) {
+        float out[4];
+        if (spec.kind == InitKind::constant) {
+            out[0] = out[1] = out[2] = out[3] = a;
+        } else {
+            Philox4x32 r((uint64_t)g, spec.stream, spec.seed);
+            if (spec.kind == InitKind::uniform || spec.kind == InitKind::xavier_uniform) {
+                for (int j = 0; j < 4; j++) out[j] = a + (b - a) * to_unit(r.v[j]);
+            } else {
+                // Box-Muller, two normals per pair of outputs
+                for (int j = 0; j < 4; j += 2) {
+                    float radius = std::sqrt(-2.0f * std::log(to_unit_open(r.v[j])));
+                    float angle = 6.2831853f * to_unit(r.v[j + 1]);
+                    out[j] = a + b * radius * std::cos(angle);
+                    out[j + 1] = a + b * radius * std::sin(angle);
+                }
+            }
+        }
+        size_t base = (size_t)g * 4;
+        for (size_t j = 0; j < 4 && base + j < n; j++) data[base + j] = out[j];
     }
 }
+
+} // namespace
+
+// Fill a tensor in place from the counter-based generator
+void init_memory(const memory& mem, const InitSpec& spec) {
+    auto md = mem.get_desc();
+    if (md.get_data_type() != memory::data_type::f32) {
+        throw std::invalid_argument("init_memory only fills f32 tensors");
+    }
+    float a = spec.a, b = spec.b;
+    if (spec.kind == InitKind::xavier_uniform || spec.kind == InitKind::xavier_normal) {
+        auto dims = md.get_dims();
+        const size_t nd = dims.size();
+        float fan_in = (float)(nd >= 2 ? dims[nd - 2] : dims[0]);
+        float fan_out = (float)dims[nd - 1];
+        if (spec.kind == InitKind::xavier_uniform) {
+            b = std::sqrt(6.0f / (fan_in + fan_out));
+            a = -b;
+        } else {
+            a = 0.0f;
+            b = std::sqrt(2.0f / (fan_in + fan_out));
+        }
+    }
+    fill(static_cast<float*>(mem.get_data_handle()), md.get_size() / sizeof(float), spec, a, b);
+}
+
+// FNV-1a, stable across runs and platforms (unlike std::hash)
+uint64_t init_stream_id(const std::string& name) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : name) {
+        h ^= c;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Fill a vector with uniform [0, 1) values
+void fill_random_data(std::vector<float>& data, uint64_t seed) {
+    InitSpec spec;
+    spec.seed = seed;
+    fill(data.data(), data.size(), spec, 0.0f, 1.0f);
+}
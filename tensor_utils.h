@@ -1,18 +1,60 @@
 #ifndef TENSOR_UTILS_H
 #define TENSOR_UTILS_H
 
+#include <cstdint>
+#include <string>
 #include <vector>
 #include "oneapi/dnnl/dnnl.hpp"
 
 using namespace dnnl;
 
 // Function to create memory descriptor
-memory::desc create_memory_desc(const memory::dims& dims, memory::format_tag format = memory::format_tag::abc);
+memory::desc create_memory_desc(const memory::dims& dims, memory::format_tag format = memory::format_tag::abc,
+    memory::data_type dt = memory::data_type::f32);
 
 // Function to initialize memory
 memory initialize_memory(const memory::desc& md, engine& eng, std::vector<float>& data);
 
-// Function to fill a tensor with random values
-void fill_random_data(std::vector<float>& data);
+// Function to create a view of part of an existing tensor. No data is
+// copied; `byte_offset` is relative to the base tensor's data handle.
+memory create_view(const memory& base, const memory::desc& md, size_t byte_offset);
+
+// Function to get the same shape and data type with format_tag::any, so a
+// primitive can pick its preferred (e.g. blocked) layout
+memory::desc any_layout(const memory::desc& md);
+
+// Function to reorder a tensor into the given layout. Returns `src` itself
+// when it is already in that layout.
+memory reorder_memory(const memory& src, const memory::desc& md, engine& eng);
+
+// Initializers for init_memory. Values come from a counter-based RNG
+// (Philox4x32-10) and depend only on (seed, stream, element index), so a
+// tensor is identical across runs and OpenMP thread counts.
+enum class InitKind {
+    constant,        // a
+    uniform,         // [a, b)
+    normal,          // mean a, stddev b
+    xavier_uniform,  // [-l, l), l = sqrt(6 / (fan_in + fan_out))
+    xavier_normal    // stddev sqrt(2 / (fan_in + fan_out))
+};
+
+struct InitSpec {
+    InitKind kind = InitKind::uniform;
+    float a = 0.0f;
+    float b = 1.0f;
+    uint64_t seed = 0;
+    uint64_t stream = 0;  // independent sequence, e.g. one per tensor
+};
+
+// Function to fill an f32 tensor in place, in parallel, straight through
+// its data handle. Xavier fans are the last two dims ([.., in, out]).
+void init_memory(const memory& mem, const InitSpec& spec);
+
+// Function to derive a stable stream id from a tensor name
+uint64_t init_stream_id(const std::string& name);
+
+// Function to fill a vector with uniform [0, 1) values. Pass the model's
+// seed (ModelConfig::seed) so inputs follow it like the weights do.
+void fill_random_data(std::vector<float>& data, uint64_t seed);
 
 #endif // TENSOR_UTILS_H